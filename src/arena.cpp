@@ -0,0 +1,72 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "arena.h"
+#include "helpers.h"
+#include <stdint.h>
+#include <string.h>
+
+#define ARENA_CHUNK (16 * 1024 * 1024)
+
+void arenainit(arena * const a) {
+	a->chunks = NULL;
+	a->bytes = 0;
+	pthread_mutex_init(&a->lock, NULL);
+}
+
+u8 *arenaroom(arena * const a, u8 **bump, u32 *room, const u32 len) {
+
+	if (*room >= len)
+		return *bump;
+
+	// The rest of the old chunk is wasted, it's less than one block
+	const u32 size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+	u8 * const chunk = (u8 *) xmalloc(size + sizeof(u8 *));
+
+	// Chained through their first bytes
+	pthread_mutex_lock(&a->lock);
+	*(u8 **) chunk = a->chunks;
+	a->chunks = chunk;
+	a->bytes += size;
+	pthread_mutex_unlock(&a->lock);
+
+	*bump = chunk + sizeof(u8 *);
+	*room = size;
+	return *bump;
+}
+
+void *arenaalloc(arena * const a, u8 **bump, u32 *room, const u32 len) {
+
+	// Compressed data leaves the bump at any byte
+	arenaroom(a, bump, room, len + 7);
+	const u32 pad = -(uintptr_t) *bump & 7;
+	u8 * const p = *bump + pad;
+	*bump += pad + len;
+	*room -= pad + len;
+
+	memset(p, 0, len);
+	return p;
+}
+
+void arenafree(arena * const a) {
+	u8 *next;
+	for (; a->chunks; a->chunks = next) {
+		next = *(u8 **) a->chunks;
+		free(a->chunks);
+	}
+	a->bytes = 0;
+}
@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+#include "lrtypes.h"
+
+// Compressed pages that live as long as the document are appended
+// into big chunks, and all go at once when it closes. Each render
+// thread bumps along its own chunk, only getting a new one locks.
+struct arena {
+	u8 *chunks;
+	u64 bytes;
+	pthread_mutex_t lock;
+};
+
+void arenainit(arena * const a);
+
+// At least len bytes at *bump. Use some and move *bump and *room along.
+u8 *arenaroom(arena * const a, u8 **bump, u32 *room, const u32 len);
+
+// Zeroed and aligned for structs, moves *bump and *room itself.
+void *arenaalloc(arena * const a, u8 **bump, u32 *room, const u32 len);
+
+void arenafree(arena * const a);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "autoconfig.h"
+#include "bbox.h"
+#include <math.h>
+#include <PDFDoc.h>
+
+#ifdef HAVE_BBOXOUTPUTDEV_H
+#include <BBoxOutputDev.h>
+#endif
+
+bool getbbox(PDFDoc * const pdf, const u32 page, const u16 dpi,
+		abortfunc stop, u32 *w, u32 *h, u32 *minx, u32 *maxx,
+		u32 *miny, u32 *maxy) {
+
+#ifdef HAVE_BBOXOUTPUTDEV_H
+	const double scale = dpi / 72.0;
+	const int rot = pdf->getPageRotate(page + 1);
+	double pw = pdf->getPageMediaWidth(page + 1) * scale;
+	double ph = pdf->getPageMediaHeight(page + 1) * scale;
+	if (rot == 90 || rot == 270) {
+		const double tmp = pw;
+		pw = ph;
+		ph = tmp;
+	}
+
+	// Same rounding as Splash uses for its bitmap
+	*w = pw + 0.5;
+	*h = ph + 0.5;
+	if (!*w || !*h)
+		return false;
+
+	BBoxOutputDev dev;
+	pdf->displayPage(&dev, page + 1, dpi, dpi, 0, true, false, false,
+				stop);
+
+	// A blank page has no bounds. A page painting its background
+	// has them everywhere, the pixels tell more there.
+	if (!dev.getHasGraphics())
+		return false;
+
+	// Not upside down, so y grows from the bottom. A pixel of slack
+	// on each side for antialiasing.
+	const double x1 = floor(dev.getX1()) - 1;
+	const double x2 = ceil(dev.getX2());
+	const double y1 = ph - ceil(dev.getY2()) - 1;
+	const double y2 = ph - floor(dev.getY1());
+
+	if (x2 <= 0 || y2 <= 0 || x1 >= pw || y1 >= ph)
+		return false;
+
+	*minx = x1 > 0 ? x1 : 0;
+	*miny = y1 > 0 ? y1 : 0;
+	*maxx = x2 < *w - 1 ? x2 : *w - 1;
+	*maxy = y2 < *h - 1 ? y2 : *h - 1;
+
+	if (*minx >= *maxx || *miny >= *maxy)
+		return false;
+
+	return *minx || *miny || *maxx < *w - 1 || *maxy < *h - 1;
+#else
+	// Poppler too old to have the device
+	(void) pdf; (void) page; (void) dpi; (void) stop;
+	(void) w; (void) h; (void) minx; (void) maxx; (void) miny; (void) maxy;
+	return false;
+#endif
+}
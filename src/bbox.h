@@ -0,0 +1,42 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BBOX_H
+#define BBOX_H
+
+#include "lrtypes.h"
+#include <glib/poppler-features.h>
+
+class PDFDoc;
+
+// Polled between content stream operators, true stops the page
+#if POPPLER_CHECK_VERSION(0, 71, 0)
+typedef bool (*abortfunc)(void *);
+#else
+#include <goo/gtypes.h>
+typedef GBool (*abortfunc)(void *);
+#endif
+
+// Bounds of what the page draws, from its drawing operations rather
+// than the pixels, at the given dpi. The page size is the one Splash
+// would render. False when the bounds are unknown, or cover the page.
+// An aborted pass leaves partial bounds, the caller has to know.
+bool getbbox(PDFDoc * const pdf, const u32 page, const u16 dpi,
+		abortfunc stop, u32 *w, u32 *h, u32 *minx, u32 *maxx,
+		u32 *miny, u32 *maxy);
+
+#endif
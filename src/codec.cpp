@@ -0,0 +1,268 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "autoconfig.h"
+#include "codec.h"
+#include "gettext.h"
+#include "helpers.h"
+#include <lzo/lzo1x.h>
+
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+// Densest without making the render threads wait on it
+#define ZSTD_LEVEL 6
+
+static const char * const names[C_COUNT] = {
+	"lzo",
+	"lzo999",
+	"lz4",
+	"zstd"
+};
+
+const char *codecname(const u8 codec) {
+	if (codec >= C_COUNT)
+		return "?";
+	return names[codec];
+}
+
+u8 findcodec(const char * const name) {
+	u8 i;
+	for (i = 0; i < C_COUNT; i++) {
+		if (!strcmp(name, names[i]))
+			return i;
+	}
+	return C_COUNT;
+}
+
+bool codecavail(const u8 codec) {
+	switch (codec) {
+		case C_LZO:
+		case C_LZO999:
+			return true;
+#ifdef HAVE_LIBLZ4
+		case C_LZ4:
+			return true;
+#endif
+#ifdef HAVE_LIBZSTD
+		case C_ZSTD:
+			return true;
+#endif
+	}
+	return false;
+}
+
+u32 codecbound(const u8 codec, const u32 len, const u32 rows) {
+	switch (codec) {
+#ifdef HAVE_LIBLZ4
+		case C_LZ4:
+			// Each run is a block of its own, with its size in front
+			return LZ4_compressBound(len) + rows * (4 + 16);
+#endif
+#ifdef HAVE_LIBZSTD
+		case C_ZSTD:
+			return ZSTD_compressBound(len);
+#endif
+	}
+
+	// LZO's documented worst case, the rows get gathered
+	(void) rows;
+	return len + len / 16 + 64 + 3;
+}
+
+#ifdef HAVE_LIBLZ4
+static u32 lz4rows(const u8 * const src, const u32 rowsize, const u32 len,
+			const u32 h, u8 * const dst, const u32 cap) {
+
+	// Every row a block, linked to the rows before. They end up next to
+	// each other when decoded, so the decoder finds the same history.
+	static __thread LZ4_stream_t *stream;
+	if (!stream) {
+		stream = LZ4_createStream();
+		if (!stream)
+			die("Out of memory\n");
+	} else {
+		LZ4_resetStream(stream);
+	}
+
+	u32 out = 0, i;
+	for (i = 0; i < h; i++) {
+		const int ret = LZ4_compress_fast_continue(stream,
+					(const char *) src + i * rowsize,
+					(char *) dst + out + 4, len,
+					cap - out - 4, 1);
+		if (ret <= 0)
+			die(_("Compression failed\n"));
+
+		const u32 size = ret;
+		memcpy(dst + out, &size, 4);
+		out += 4 + size;
+	}
+
+	return out;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+static u32 zstdrows(const u8 * const src, const u32 rowsize, const u32 len,
+			const u32 h, u8 * const dst, const u32 cap) {
+
+	// One frame, fed a row at a time
+	static __thread ZSTD_CCtx *ctx;
+	if (!ctx) {
+		ctx = ZSTD_createCCtx();
+		if (!ctx)
+			die("Out of memory\n");
+		ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+	}
+	ZSTD_CCtx_reset(ctx, ZSTD_reset_session_only);
+	ZSTD_CCtx_setPledgedSrcSize(ctx, (unsigned long long) len * h);
+
+	ZSTD_outBuffer out = { dst, cap, 0 };
+	u32 i;
+	for (i = 0; i < h; i++) {
+		ZSTD_inBuffer in = { src + i * rowsize, len, 0 };
+		const ZSTD_EndDirective end = i == h - 1 ? ZSTD_e_end :
+							ZSTD_e_continue;
+		size_t left;
+		do {
+			left = ZSTD_compressStream2(ctx, &out, &in, end);
+			if (ZSTD_isError(left))
+				die(_("Compression failed\n"));
+		} while (end == ZSTD_e_end ? left != 0 : in.pos < in.size);
+	}
+
+	return out.pos;
+}
+#endif
+
+u32 encode(const u8 codec, const u8 * const src, const u32 len,
+		u8 * const dst, const u32 cap) {
+	return encoderows(codec, src, len, len, 1, dst, cap);
+}
+
+u32 encoderows(const u8 codec, const u8 * const src, const u32 rowsize,
+		const u32 len, const u32 h, u8 * const dst, const u32 cap) {
+
+	// Rows that follow each other are one run
+	if (rowsize == len && h > 1)
+		return encoderows(codec, src, len * h, len * h, 1, dst, cap);
+
+	lzo_uint outlen = cap;
+	const u8 *in = src;
+	int ret;
+
+	switch (codec) {
+#ifdef HAVE_LIBLZ4
+		case C_LZ4:
+			return lz4rows(src, rowsize, len, h, dst, cap);
+#endif
+#ifdef HAVE_LIBZSTD
+		case C_ZSTD:
+			return zstdrows(src, rowsize, len, h, dst, cap);
+#endif
+		case C_LZO:
+		case C_LZO999:
+			// No streaming API, the rows get gathered
+			if (h > 1) {
+				static __thread u8 *rows;
+				static __thread u32 rowssize;
+				if (len * h > rowssize) {
+					rowssize = len * h;
+					rows = (u8 *) realloc(rows, rowssize);
+					if (!rows)
+						die("Out of memory\n");
+				}
+
+				u32 i;
+				for (i = 0; i < h; i++)
+					memcpy(rows + i * len, src + i * rowsize, len);
+				in = rows;
+			}
+		break;
+		default:
+			die(_("Codec %s not available\n"), codecname(codec));
+	}
+
+	if (codec == C_LZO) {
+		u8 workmem[LZO1X_1_MEM_COMPRESS]; // 64kb, we can afford it
+		ret = lzo1x_1_compress(in, len * h, dst, &outlen, workmem);
+	} else {
+		// Too big for the stack, each thread keeps its own
+		static __thread void *workmem;
+		if (!workmem)
+			workmem = xcalloc(1, LZO1X_999_MEM_COMPRESS);
+		ret = lzo1x_999_compress(in, len * h, dst, &outlen, workmem);
+	}
+	if (ret != LZO_E_OK)
+		die(_("Compression failed\n"));
+
+	return outlen;
+}
+
+bool decode(const u8 codec, const u8 * const src, const u32 srclen,
+		u8 * const dst, const u32 len) {
+
+	lzo_uint outlen = len;
+
+	switch (codec) {
+		case C_LZO:
+		case C_LZO999:
+			// Both are read by the same decompressor. The checked
+			// one, blocks may come from a damaged cache file.
+			if (lzo1x_decompress_safe(src, srclen, dst, &outlen, NULL) !=
+				LZO_E_OK)
+				return false;
+			return outlen == len;
+#ifdef HAVE_LIBLZ4
+		case C_LZ4: {
+			// Blocks with their sizes in front, each decoded right
+			// after the last with it as history
+			u32 in = 0, out = 0, size;
+			while (in < srclen) {
+				if (srclen - in < 4)
+					return false;
+				memcpy(&size, src + in, 4);
+				in += 4;
+				if (size > srclen - in)
+					return false;
+
+				const int ret = LZ4_decompress_safe_usingDict(
+							(const char *) src + in,
+							(char *) dst + out, size, len - out,
+							(const char *) dst, out);
+				if (ret < 0)
+					return false;
+				in += size;
+				out += ret;
+			}
+			return out == len;
+		}
+#endif
+#ifdef HAVE_LIBZSTD
+		case C_ZSTD:
+			return ZSTD_decompress(dst, len, src, srclen) == len;
+#endif
+	}
+
+	return false;
+}
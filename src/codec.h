@@ -0,0 +1,56 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "lrtypes.h"
+
+// What a stored block was compressed with
+enum codecid {
+	C_LZO = 0,
+	C_LZO999,
+	C_LZ4,
+	C_ZSTD,
+	C_COUNT
+};
+
+const char *codecname(const u8 codec);
+
+// C_COUNT if unknown
+u8 findcodec(const char * const name);
+
+// Whether this build was linked with it
+bool codecavail(const u8 codec);
+
+// The largest output compressing len bytes, coming in rows runs, can give
+u32 codecbound(const u8 codec, const u32 len, const u32 rows);
+
+// Returns the compressed size
+u32 encode(const u8 codec, const u8 * const src, const u32 len,
+		u8 * const dst, const u32 cap);
+
+// Same from h rows of len bytes each, rowsize apart, without gathering
+// them first where the codec can stream
+u32 encoderows(const u8 codec, const u8 * const src, const u32 rowsize,
+		const u32 len, const u32 h, u8 * const dst, const u32 cap);
+
+// False if the data is corrupt or doesn't decompress to exactly len
+bool decode(const u8 codec, const u8 * const src, const u32 srclen,
+		u8 * const dst, const u32 len);
+
+#endif
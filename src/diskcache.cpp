@@ -0,0 +1,468 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "main.h"
+#include "diskcache.h"
+#include "codec.h"
+#include "planes.h"
+#include <limits.h>
+#include <utime.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define DISK_MAGIC "FLAXPDF"
+#define DISK_VERSION 3
+
+struct diskheader {
+	char magic[8];
+	u32 version;
+	u32 pages;
+
+	// The key
+	u64 dev, ino, size, mtime;
+	u32 dpi;
+};
+
+struct diskpage {
+	u32 w, h;
+	u16 left, right, top, bottom;
+	u8 bbox;
+};
+
+// Each page has one of these for every saved level
+struct disklevel {
+	// Zero if the level wasn't there
+	u32 numblocks;
+	u32 lw, lh;
+	u16 dpi;
+};
+
+struct diskblock {
+	u32 size;
+	u32 x, y, w, h;
+	u8 codec;
+	u8 format;
+};
+
+// The full level, and the ones made from it
+static const u8 savedlevels[] = { L_FULL, L_HALF, L_PREVIEW };
+static const u16 saveddpis[] = { FULL_DPI, HALF_DPI, PREVIEW_DPI };
+
+static u8 *map;
+static size_t mapsize;
+static u32 loaded;
+static bool damaged;
+
+static bool cachedir(char * const dir, const u32 len) {
+
+	const char *base = getenv("XDG_CACHE_HOME");
+	char home[PATH_MAX];
+
+	if (!base || !*base) {
+		const char * const h = getenv("HOME");
+		if (!h)
+			return false;
+		snprintf(home, PATH_MAX, "%s/.cache", h);
+		mkdir(home, 0700);
+		base = home;
+	}
+
+	snprintf(dir, len, "%s/flaxpdf", base);
+	return !mkdir(dir, 0700) || errno == EEXIST;
+}
+
+static bool cachepath(char * const path, const u32 len,
+			diskheader * const key) {
+
+	struct stat st;
+	if (stat(file->name, &st))
+		return false;
+
+	memset(key, 0, sizeof(diskheader));
+	memcpy(key->magic, DISK_MAGIC, sizeof(DISK_MAGIC));
+	key->version = DISK_VERSION;
+	key->pages = file->pages;
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->size = st.st_size;
+	key->mtime = st.st_mtime;
+	key->dpi = FULL_DPI;
+
+	// FNV-1a of the key names the file
+	u64 hash = 14695981039346656037ULL;
+	const u8 * const p = (const u8 *) key;
+	u32 i;
+	for (i = 0; i < sizeof(diskheader); i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+
+	char dir[PATH_MAX];
+	if (!cachedir(dir, PATH_MAX))
+		return false;
+
+	snprintf(path, len, "%s/%016llx.cache", dir, (unsigned long long) hash);
+	return true;
+}
+
+static bool loadlevel(size_t * const off, pagelevel * const l,
+			const u16 dpi) {
+
+	disklevel dl;
+	if (*off + sizeof(disklevel) > mapsize)
+		return false;
+	memcpy(&dl, map + *off, sizeof(disklevel));
+	*off += sizeof(disklevel);
+
+	if (!dl.numblocks)
+		return true;
+
+	// Each block needs at least its header, so a count the rest of the
+	// file can't hold is garbage, not something to allocate for
+	if (dl.numblocks > (mapsize - *off) / sizeof(diskblock))
+		return false;
+	if (dl.dpi != dpi || !dl.lw || !dl.lh ||
+		(u64) dl.lw * dl.lh * 4 > UINT_MAX)
+		return false;
+
+	// Before the render threads start, so the first worker's part of
+	// the arena is free to use. Lazy mode may drop these, they're malloced.
+	const bool inarena = !lazy;
+	renderworker * const wk = &file->workers[0];
+	pageblock * const blocks = inarena ?
+		(pageblock *) arenaalloc(&file->arena, &wk->bump, &wk->room,
+					dl.numblocks * sizeof(pageblock)) :
+		(pageblock *) xcalloc(dl.numblocks, sizeof(pageblock));
+	u32 size = 0, j;
+	bool ok = true;
+	for (j = 0; j < dl.numblocks && ok; j++) {
+		diskblock db;
+		ok = *off + sizeof(diskblock) <= mapsize;
+		if (!ok)
+			break;
+		memcpy(&db, map + *off, sizeof(diskblock));
+		*off += sizeof(diskblock);
+
+		ok = db.size <= mapsize - *off && codecavail(db.codec) &&
+			db.format < PF_COUNT &&
+			db.w && db.w <= dl.lw && db.x <= dl.lw - db.w &&
+			db.h && db.h <= dl.lh && db.y <= dl.lh - db.h;
+
+		pageblock * const b = &blocks[j];
+		b->data = map + *off;
+		b->size = db.size;
+		b->x = db.x;
+		b->y = db.y;
+		b->w = db.w;
+		b->h = db.h;
+		b->codec = db.codec;
+		b->format = db.format;
+
+		*off += db.size;
+		size += db.size;
+	}
+
+	if (!ok) {
+		if (!inarena)
+			free(blocks);
+		return false;
+	}
+
+	l->blocks = blocks;
+	l->numblocks = dl.numblocks;
+	l->inarena = inarena;
+	l->size = size;
+	l->uncompressed = dl.lw * dl.lh * 4;
+	l->w = dl.lw;
+	l->h = dl.lh;
+	l->dpi = dl.dpi;
+	l->ready = l->claimed = true;
+	return true;
+}
+
+u32 diskload() {
+
+	loaded = 0;
+	if (!maxdisk)
+		return 0;
+
+	char path[PATH_MAX];
+	diskheader key, head;
+	if (!cachepath(path, PATH_MAX, &key))
+		return 0;
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(diskheader)) {
+		close(fd);
+		return 0;
+	}
+
+	void * const m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return 0;
+
+	map = (u8 *) m;
+	mapsize = st.st_size;
+
+	memcpy(&head, map, sizeof(diskheader));
+	if (memcmp(&head, &key, sizeof(diskheader))) {
+		diskclose();
+		return 0;
+	}
+
+	// Walk the pages. Anything that doesn't add up ends the walk,
+	// those pages just get rendered.
+	size_t off = sizeof(diskheader);
+	u32 i, j;
+	for (i = 0; i < file->pages; i++) {
+		diskpage dp;
+		if (off + sizeof(diskpage) > mapsize)
+			break;
+		memcpy(&dp, map + off, sizeof(diskpage));
+		off += sizeof(diskpage);
+
+		pagelevel levels[sizeof(savedlevels)];
+		memset(levels, 0, sizeof(levels));
+		bool ok = true;
+		for (j = 0; j < sizeof(savedlevels) && ok; j++)
+			ok = loadlevel(&off, &levels[j], saveddpis[j]);
+
+		if (!ok) {
+			for (j = 0; j < sizeof(savedlevels); j++) {
+				if (!levels[j].inarena)
+					free(levels[j].blocks);
+			}
+			break;
+		}
+
+		// Nothing else runs yet, no need to lock
+		cachedpage * const cur = &file->cache[i];
+		for (j = 0; j < sizeof(savedlevels); j++) {
+			if (!levels[j].numblocks)
+				continue;
+			cur->level[savedlevels[j]] = levels[j];
+			file->cachebytes += levels[j].size;
+			if (!levels[j].inarena)
+				file->heaplevels++;
+		}
+
+		if (!levels[0].numblocks)
+			continue;
+
+		cur->w = dp.w;
+		cur->h = dp.h;
+		cur->left = dp.left;
+		cur->right = dp.right;
+		cur->top = dp.top;
+		cur->bottom = dp.bottom;
+		cur->bbox = dp.bbox == BB_OK ? BB_OK : BB_NONE;
+		cur->exact = cur->bbox == BB_NONE;
+		cur->ready = true;
+
+		loaded++;
+	}
+
+	// Used now, so it's the last to go
+	utime(path, NULL);
+
+	return loaded;
+}
+
+static void trim(const char * const keep) {
+
+	char dir[PATH_MAX], path[PATH_MAX];
+	if (!cachedir(dir, PATH_MAX))
+		return;
+
+	// Drop the least recently used files until within the cap
+	while (1) {
+		DIR * const d = opendir(dir);
+		if (!d)
+			return;
+
+		u64 total = 0;
+		time_t oldest = 0;
+		char victim[PATH_MAX] = "";
+
+		const struct dirent *de;
+		while ((de = readdir(d))) {
+			const u32 len = strlen(de->d_name);
+			if (len < 6 || strcmp(de->d_name + len - 6, ".cache"))
+				continue;
+
+			snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name);
+			struct stat st;
+			if (stat(path, &st))
+				continue;
+
+			total += st.st_size;
+			if (!strcmp(path, keep))
+				continue;
+			if (!*victim || st.st_mtime < oldest) {
+				oldest = st.st_mtime;
+				strcpy(victim, path);
+			}
+		}
+		closedir(d);
+
+		if (total <= maxdisk || !*victim)
+			return;
+
+		unlink(victim);
+	}
+}
+
+static bool savelevel(FILE * const f, const pagelevel * const l) {
+
+	disklevel dl;
+	memset(&dl, 0, sizeof(disklevel));
+	if (l) {
+		dl.numblocks = l->numblocks;
+		dl.lw = l->w;
+		dl.lh = l->h;
+		dl.dpi = l->dpi;
+	}
+
+	bool ok = fwrite(&dl, sizeof(disklevel), 1, f) == 1;
+	u32 j;
+	for (j = 0; j < dl.numblocks && ok; j++) {
+		const pageblock * const b = &l->blocks[j];
+		diskblock db;
+		memset(&db, 0, sizeof(diskblock));
+		db.size = b->size;
+		db.x = b->x;
+		db.y = b->y;
+		db.w = b->w;
+		db.h = b->h;
+		db.codec = b->codec;
+		db.format = b->format;
+
+		ok = fwrite(&db, sizeof(diskblock), 1, f) == 1 &&
+			fwrite(b->data, b->size, 1, f) == 1;
+	}
+
+	return ok;
+}
+
+void disksave() {
+
+	if (!maxdisk)
+		return;
+
+	// Nothing new since the load
+	u32 i, j, have = 0;
+	for (i = 0; i < file->pages; i++) {
+		if (file->cache[i].level[L_FULL].ready)
+			have++;
+	}
+	if (have <= loaded)
+		return;
+
+	char path[PATH_MAX], tmp[PATH_MAX];
+	diskheader key;
+	if (!cachepath(path, PATH_MAX, &key))
+		return;
+
+	snprintf(tmp, PATH_MAX, "%s.%u", path, (u32) getpid());
+	FILE * const f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	bool ok = fwrite(&key, sizeof(diskheader), 1, f) == 1;
+
+	// A page at a time, so the view isn't kept waiting. The mapped
+	// file we may be reading from stays valid after the rename.
+	for (i = 0; i < file->pages && ok; i++) {
+		// Opening another file waits for this thread
+		if (__sync_fetch_and_add(&file->cancel, 0)) {
+			fclose(f);
+			unlink(tmp);
+			return;
+		}
+
+		const cachedpage * const cur = &file->cache[i];
+		diskpage dp;
+		memset(&dp, 0, sizeof(diskpage));
+
+		pthread_mutex_lock(&file->lock);
+		const bool full = cur->level[L_FULL].ready;
+		if (full) {
+			dp.w = cur->w;
+			dp.h = cur->h;
+			dp.left = cur->left;
+			dp.right = cur->right;
+			dp.top = cur->top;
+			dp.bottom = cur->bottom;
+			dp.bbox = cur->bbox;
+		}
+
+		ok = fwrite(&dp, sizeof(diskpage), 1, f) == 1;
+		for (j = 0; j < sizeof(savedlevels) && ok; j++) {
+			const pagelevel * const l = &cur->level[savedlevels[j]];
+			ok = savelevel(f, full && l->ready ? l : NULL);
+		}
+		pthread_mutex_unlock(&file->lock);
+	}
+
+	if (fclose(f) || !ok) {
+		unlink(tmp);
+		return;
+	}
+
+	if (rename(tmp, path)) {
+		unlink(tmp);
+		return;
+	}
+
+	if (details)
+		printf(_("Saved %u pages to %s\n"), have, path);
+
+	trim(path);
+}
+
+void diskclose() {
+	if (map)
+		munmap(map, mapsize);
+	map = NULL;
+	mapsize = 0;
+	loaded = 0;
+	damaged = false;
+}
+
+bool diskbacked(const u8 * const data) {
+	return map && data >= map && data < map + mapsize;
+}
+
+void diskdamaged() {
+
+	// The mapping stays valid after the unlink
+	if (__sync_lock_test_and_set(&damaged, true))
+		return;
+
+	char path[PATH_MAX];
+	diskheader key;
+	if (cachepath(path, PATH_MAX, &key))
+		unlink(path);
+}
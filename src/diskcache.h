@@ -0,0 +1,46 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include "lrtypes.h"
+
+// Rendered pages kept on disk between runs, keyed by the file's
+// identity and the resolution. The pages are used straight from
+// the mapped cache file.
+
+// Fills in the full levels a previous run saved, and the smaller ones
+// made from them. Returns how many pages.
+u32 diskload();
+
+// Saves the pages that have their full level, with the smaller ones
+// made from it, then trims the cache directory to maxdisk, oldest
+// used first
+void disksave();
+
+// Done with the current file's mapping
+void diskclose();
+
+// Whether a block's data is in the mapped cache file
+bool diskbacked(const u8 * const data);
+
+// A block from it didn't decode. The file goes, so the next run
+// renders the pages again.
+void diskdamaged();
+
+#endif
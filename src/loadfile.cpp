@@ -15,74 +15,335 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "main.h"
+#include "bbox.h"
+#include "codec.h"
+#include "diskcache.h"
+#include "margins.h"
+#include "mip.h"
+#include "planes.h"
+#include "prefetch.h"
 #include <FL/Fl_File_Chooser.H>
 #include <omp.h>
 #include <ErrorCodes.h>
 #include <GlobalParams.h>
 #include <SplashOutputDev.h>
 #include <splash/SplashBitmap.h>
+#include <glib/poppler-features.h>
+
+// Pages bigger than this are rendered and stored in tiles
+#define TILE_LIMIT (32 * 1024 * 1024)
+#define TILE_SIZE 1024
+
+// Other pages are stored in strips of this many rows, so the view only
+// decompresses the part on screen
+#define STRIP_ROWS 256
+
+static u8 pickcodec(const u8 lvl) {
+	// Zoomed levels are short-lived and decoded while scrolling,
+	// so they get the fastest decoder there is
+	if (lvl == L_ZOOM && codecavail(C_LZ4))
+		return C_LZ4;
+	return doccodec;
+}
 
-static bool nonwhite(const u8 * const pixel) {
+static bool pooled(const u8 lvl) {
+	// The levels that stay until the document closes go in the arena.
+	// Zoomed ones get replaced, and lazy mode drops pages as it goes.
+	// A rendered preview is replaced by the full level's mips, those
+	// pass L_FULL, they last as long as it.
+	return !lazy && lvl != L_ZOOM && lvl != L_PREVIEW;
+}
 
-	return pixel[0] != 255 ||
-		pixel[1] != 255 ||
-		pixel[2] != 255;
+static u8 *scratch(u8 ** const buf, u32 * const size, const u32 len) {
+	if (len > *size) {
+		*size = len;
+		*buf = (u8 *) realloc(*buf, len);
+		if (!*buf)
+			die("Out of memory\n");
+	}
+	return *buf;
 }
 
-static void getmargins(const u8 * const src, const u32 w, const u32 h,
-			const u32 rowsize, u32 *minx, u32 *maxx,
-			u32 *miny, u32 *maxy) {
+static void compress(renderworker * const wk, const bool keep,
+			const u8 * const src, const u32 rowsize,
+			const u32 w, const u32 h, const u8 codec,
+			pageblock * const b) {
+
+	// Text pages are mostly gray or black and white, those keep
+	// a byte or a bit per pixel instead of four. Full color rows are
+	// compressed where they are, trimmed or not.
+	const u8 format = detect(src, rowsize, w, h);
+	const u32 len = planesize(format, w, h);
+	const u8 *in = src;
+	u32 inrow = rowsize, rows = h;
+	if (format != PF_XBGR) {
+		u8 * const packed = scratch(&wk->packed, &wk->packedsize, len);
+		pack(format, src, rowsize, w, h, packed);
+		in = packed;
+		inrow = len;
+		rows = 1;
+	}
 
-	int i, j;
+	// Into the arena it goes in place, otherwise it gets an exact-size
+	// copy. That's the only allocation.
+	const u32 rowlen = len / rows;
+	const u32 cap = codecbound(codec, len, rows);
+	u8 *dst;
+	u32 outlen;
+	if (keep) {
+		dst = arenaroom(&file->arena, &wk->bump, &wk->room, cap);
+		outlen = encoderows(codec, in, inrow, rowlen, rows, dst, cap);
+		wk->bump += outlen;
+		wk->room -= outlen;
+	} else {
+		u8 * const tmp = scratch(&wk->out, &wk->outsize, cap);
+		outlen = encoderows(codec, in, inrow, rowlen, rows, tmp, cap);
 
-	bool found = false;
-	for (i = 0; i < (int) w && !found; i++) {
-		for (j = 0; j < (int) h && !found; j++) {
-			const u8 * const pixel = src + j * rowsize + i * 4;
-			if (nonwhite(pixel)) {
-				found = true;
-				*minx = i;
-			}
-		}
+		dst = (u8 *) xmalloc(outlen);
+		memcpy(dst, tmp, outlen);
 	}
 
-	found = false;
-	for (j = 0; j < (int) h && !found; j++) {
-		for (i = *minx; i < (int) w && !found; i++) {
-			const u8 * const pixel = src + j * rowsize + i * 4;
-			if (nonwhite(pixel)) {
-				found = true;
-				*miny = j;
-			}
-		}
+	b->w = w;
+	b->h = h;
+	b->size = outlen;
+	b->data = dst;
+	b->owned = !keep;
+	b->codec = codec;
+	b->format = format;
+}
+
+static pageblock *newblocks(renderworker * const wk, const bool keep,
+				const u32 num) {
+	// Kept levels have their array in the arena along with the data
+	if (keep)
+		return (pageblock *) arenaalloc(&file->arena, &wk->bump,
+						&wk->room, num * sizeof(pageblock));
+	return (pageblock *) xcalloc(num, sizeof(pageblock));
+}
+
+static void freeblocks(pageblock * const blocks, const u32 num,
+			const bool inarena) {
+	u32 i;
+	for (i = 0; i < num; i++) {
+		if (blocks[i].owned)
+			free(blocks[i].data);
 	}
+	if (!inarena)
+		free(blocks);
+}
 
-	const int startx = *minx, starty = *miny;
+static void retire(pageblock * const blocks, const u32 num,
+			const bool inarena) {
+	// With file->lock held, while someone has the blocks pinned
+	retiredblocks * const r = (retiredblocks *) xmalloc(sizeof(retiredblocks));
+	r->blocks = blocks;
+	r->num = num;
+	r->inarena = inarena;
+	r->next = file->retired;
+	file->retired = r;
+}
 
-	found = false;
-	for (i = w - 1; i >= startx && !found; i--) {
-		for (j = h - 1; j >= starty && !found; j--) {
-			const u8 * const pixel = src + j * rowsize + i * 4;
-			if (nonwhite(pixel)) {
-				found = true;
-				*maxx = i;
-			}
-		}
+void pinblocks() {
+	// With file->lock held. The block data stays valid after unlocking,
+	// until unpinblocks(), even if the level is replaced or dropped.
+	file->pins++;
+}
+
+void unpinblocks() {
+	pthread_mutex_lock(&file->lock);
+	retiredblocks *r = NULL;
+	if (!--file->pins) {
+		r = file->retired;
+		file->retired = NULL;
 	}
+	pthread_mutex_unlock(&file->lock);
 
-	found = false;
-	for (j = h - 1; j >= starty && !found; j--) {
-		for (i = *maxx; i >= startx && !found; i--) {
-			const u8 * const pixel = src + j * rowsize + i * 4;
-			if (nonwhite(pixel)) {
-				found = true;
-				*maxy = j;
-			}
+	while (r) {
+		retiredblocks * const next = r->next;
+		freeblocks(r->blocks, r->num, r->inarena);
+		free(r);
+		r = next;
+	}
+}
+
+static void publish(const u32 page, const u8 lvl, const u16 dpi,
+			pageblock * const blocks, const u32 num,
+			const bool inarena, const u32 w, const u32 h) {
+
+	pagelevel * const l = &file->cache[page].level[lvl];
+	u32 size = 0, i;
+	for (i = 0; i < num; i++)
+		size += blocks[i].size;
+
+	// The view may be showing the zoomed level this replaces
+	pthread_mutex_lock(&file->lock);
+	pageblock *old = l->blocks;
+	const u32 oldnum = l->numblocks;
+	const bool oldarena = l->inarena;
+	if (old && !oldarena)
+		file->heaplevels--;
+	if (!inarena)
+		file->heaplevels++;
+	if (lvl == L_ZOOM) {
+		file->zoombytes -= l->size;
+		file->zoombytes += size;
+	}
+	file->cachebytes -= l->size;
+	file->cachebytes += size;
+
+	l->blocks = blocks;
+	l->numblocks = num;
+	l->inarena = inarena;
+	l->size = size;
+	l->uncompressed = w * h * 4;
+	l->w = w;
+	l->h = h;
+	l->dpi = dpi;
+	if (old && file->pins) {
+		retire(old, oldnum, oldarena);
+		old = NULL;
+	}
+	pthread_mutex_unlock(&file->lock);
+
+	if (old)
+		freeblocks(old, oldnum, oldarena);
+}
+
+static void strips(renderworker * const wk, const bool keep,
+			const u8 * const src, const u32 rowsize,
+			const u32 w, const u32 h,
+			const u32 page, const u8 lvl, const u16 dpi) {
+
+	const u32 num = (h + STRIP_ROWS - 1) / STRIP_ROWS;
+	pageblock * const b = newblocks(wk, keep, num);
+	u32 i;
+	for (i = 0; i < num; i++) {
+		b[i].y = i * STRIP_ROWS;
+		compress(wk, keep, src + b[i].y * rowsize, rowsize, w,
+				h - b[i].y < STRIP_ROWS ? h - b[i].y : STRIP_ROWS,
+				pickcodec(lvl), &b[i]);
+	}
+
+	publish(page, lvl, dpi, b, num, keep, w, h);
+}
+
+// Each level is the one above halved, so the view has one near any
+// small zoom: less to upload, and less for the bilinear blit to alias.
+// The quarter one stands in for the rendered preview.
+#define MIP_LEVELS 2
+static const u8 miplvls[MIP_LEVELS] = { L_HALF, L_PREVIEW };
+static const u16 mipdpis[MIP_LEVELS] = { HALF_DPI, PREVIEW_DPI };
+
+static void mipped(const u32 page, const u8 lvl) {
+	cachedpage * const cur = &file->cache[page];
+	__sync_bool_compare_and_swap(&cur->level[lvl].claimed, 0, 1);
+	__sync_bool_compare_and_swap(&cur->level[lvl].ready, 0, 1);
+}
+
+static void mips(renderworker * const wk, const u8 *src, u32 rowsize,
+			u32 w, u32 h, const u32 page) {
+	u32 i;
+	for (i = 0; i < MIP_LEVELS; i++) {
+		if (w < 2 || h < 2)
+			break;
+		w /= 2;
+		h /= 2;
+
+		u8 * const dst = scratch(&wk->mip[i], &wk->mipsize[i], w * h * 4);
+		halve(src, rowsize, w, h, dst);
+		strips(wk, pooled(L_FULL), dst, w * 4, w, h, page,
+			miplvls[i], mipdpis[i]);
+		mipped(page, miplvls[i]);
+
+		src = dst;
+		rowsize = w * 4;
+	}
+}
+
+static void miptile(renderworker * const wk, const u8 *src, u32 rowsize,
+			u32 w, u32 h, u32 x, u32 y,
+			pageblock * const * const out, u32 * const num) {
+
+	// A tile's part of each smaller level. Only the last tiles of a row
+	// or column can be odd sized, so the halves still line up.
+	u32 i;
+	for (i = 0; i < MIP_LEVELS; i++) {
+		w /= 2;
+		h /= 2;
+		x /= 2;
+		y /= 2;
+		if (!w || !h)
+			break;
+
+		u8 * const dst = scratch(&wk->mip[i], &wk->mipsize[i], w * h * 4);
+		halve(src, rowsize, w, h, dst);
+
+		pageblock * const b = &out[i][num[i]++];
+		b->x = x;
+		b->y = y;
+		compress(wk, pooled(L_FULL), dst, w * 4, w, h,
+			pickcodec(miplvls[i]), b);
+
+		src = dst;
+		rowsize = w * 4;
+	}
+}
+
+static void touched(const u32 page) {
+	__sync_fetch_and_or(&file->dirty[page / 64], 1ULL << (page % 64));
+	__sync_fetch_and_add(&file->geomgen, 1);
+}
+
+static void relayout() {
+	const u8 msg = MSG_LAYOUT;
+	swrite(writepipe, &msg, 1);
+}
+
+static void growmax(const u32 w, const u32 h) {
+
+	// Kept current as the pages come in. The view only needs to
+	// relayout when they change.
+	bool grew = false;
+	u32 old;
+	while ((old = file->maxw) < w) {
+		if (__sync_bool_compare_and_swap(&file->maxw, old, w)) {
+			grew = true;
+			break;
+		}
+	}
+	while ((old = file->maxh) < h) {
+		if (__sync_bool_compare_and_swap(&file->maxh, old, h)) {
+			grew = true;
+			break;
 		}
 	}
+
+	if (grew)
+		relayout();
 }
 
-static void store(SplashBitmap * const bm, const u32 page) {
+static void setmax() {
+
+	// Exact once the pass is done, a preview's estimate may have been
+	// bigger than the final margins
+	u32 maxw = 0, maxh = 0;
+	for (u32 i = 0; i < file->pages; i++) {
+		if (file->cache[i].w > maxw)
+			maxw = file->cache[i].w;
+		if (file->cache[i].h > maxh)
+			maxh = file->cache[i].h;
+	}
+
+	if (maxw == file->maxw && maxh == file->maxh)
+		return;
+
+	file->maxw = maxw;
+	file->maxh = maxh;
+	relayout();
+}
+
+static void store(renderworker * const wk, SplashBitmap * const bm,
+			const u32 page, const u8 lvl, const u16 dpi) {
 
 	const u32 w = bm->getWidth();
 	const u32 h = bm->getHeight();
@@ -90,78 +351,469 @@ static void store(SplashBitmap * const bm, const u32 page) {
 
 	const u8 * const src = bm->getDataPtr();
 	u32 minx = 0, miny = 0, maxx = w - 1, maxy = h - 1;
-
-	// Trim margins
-	getmargins(src, w, h, rowsize, &minx, &maxx, &miny, &maxy);
+	cachedpage * const cur = &file->cache[page];
+	const bool vector = cur->bbox == BB_OK;
+
+	// Trim margins. A zoomed render is already cut to the trimmed area,
+	// and the drawing operations may have told us the rest.
+	if (lvl != L_ZOOM && vector) {
+		const float scale = dpi / (float) FULL_DPI;
+		minx = cur->left * scale;
+		miny = cur->top * scale;
+		maxx = (cur->left + cur->w - 1) * scale;
+		maxy = (cur->top + cur->h - 1) * scale;
+		if (maxx > w - 1)
+			maxx = w - 1;
+		if (maxy > h - 1)
+			maxy = h - 1;
+	} else if (lvl != L_ZOOM) {
+		getmargins(src, w, h, rowsize, &minx, &maxx, &miny, &maxy);
+	}
 
 	const u32 trimw = maxx - minx + 1;
 	const u32 trimh = maxy - miny + 1;
+	const u8 * const trimmed = src + miny * rowsize + minx * 4;
+
+	strips(wk, pooled(lvl), trimmed, rowsize, trimw, trimh, page, lvl, dpi);
+	if (lvl == L_FULL)
+		mips(wk, trimmed, rowsize, trimw, trimh, page);
+
+	// The full resolution margins win, even once that level has been
+	// dropped. A preview only gives the geometry a first estimate.
+	// If the bounds arrived while we were scanning, the pixels still
+	// win, they're what we stored.
+	pthread_mutex_lock(&file->lock);
+	if (!vector && (lvl == L_FULL || (lvl == L_PREVIEW && !cur->exact))) {
+		const u32 scale = FULL_DPI / dpi;
+		cur->w = trimw * scale;
+		cur->h = trimh * scale;
+		cur->left = minx * scale;
+		cur->right = (w - maxx) * scale;
+		cur->top = miny * scale;
+		cur->bottom = (h - maxy) * scale;
+		cur->bbox = BB_NONE;
+		cur->exact = lvl == L_FULL;
+	}
+	const u32 curw = cur->w, curh = cur->h;
+	pthread_mutex_unlock(&file->lock);
+
+	growmax(curw, curh);
+}
+
+// Not a level, a job to find a page's bounds
+#define J_BOUNDS L_COUNT
+
+static bool cancelled() {
+	return __sync_fetch_and_add(&file->cancel, 0);
+}
 
-	u8 * const trimmed = (u8 *) xcalloc(trimw * trimh * 4, 1);
-	u32 j;
-	for (j = miny; j <= maxy; j++) {
-		const u32 destj = j - miny;
-		memcpy(trimmed + destj * trimw * 4, src + j * rowsize + minx * 4, trimw * 4);
+// Poppler polls this between content stream operators
+#if POPPLER_CHECK_VERSION(0, 71, 0)
+static bool abortcheck(void *) {
+#else
+static GBool abortcheck(void *) {
+#endif
+	return cancelled();
+}
+
+static void bound(renderworker * const w, const u32 page) {
+
+	// Margins from the drawing operations, before there are any pixels.
+	// Much cheaper than rendering, and store() can skip its scan.
+	cachedpage * const cur = &file->cache[page];
+	if (__sync_fetch_and_add(&cur->bbox, 0) != BB_UNKNOWN)
+		return;
+
+	u32 pw, ph, minx, maxx, miny, maxy;
+	const bool ok = getbbox(w->pdf, page, FULL_DPI, abortcheck, &pw, &ph,
+				&minx, &maxx, &miny, &maxy);
+	if (cancelled())
+		return;
+
+	// A level stored meanwhile already has its margins
+	pthread_mutex_lock(&file->lock);
+	if (cur->bbox == BB_UNKNOWN) {
+		if (ok && !cur->level[L_FULL].blocks &&
+			!cur->level[L_PREVIEW].blocks) {
+			cur->w = maxx - minx + 1;
+			cur->h = maxy - miny + 1;
+			cur->left = minx;
+			cur->right = pw - maxx;
+			cur->top = miny;
+			cur->bottom = ph - maxy;
+			cur->bbox = BB_OK;
+		} else {
+			cur->bbox = BB_NONE;
+		}
 	}
+	const u32 curw = cur->w, curh = cur->h;
+	const bool vector = cur->bbox == BB_OK;
+	pthread_mutex_unlock(&file->lock);
 
-	// Trimmed copy done, compress it
-	u8 * const tmp = (u8 *) xcalloc(trimw * trimh * 4 * 1.08f, 1);
-	u8 workmem[LZO1X_1_MEM_COMPRESS]; // 64kb, we can afford it
-	lzo_uint outlen;
-	int ret = lzo1x_1_compress(trimmed, trimw * trimh * 4, tmp, &outlen, workmem);
-	if (ret != LZO_E_OK)
-		die(_("Compression failed\n"));
+	growmax(curw, curh);
 
-	free(trimmed);
+	// The view can use the trimmed size right away
+	if (vector)
+		touched(page);
+}
 
-	u8 * const dst = (u8 *) xcalloc(outlen, 1);
-	memcpy(dst, tmp, outlen);
-	free(tmp);
+// Compressed bytes the zoomed levels may take in total
+#define ZOOM_BUDGET (64 * 1024 * 1024)
 
-	// Store
-	file->cache[page].uncompressed = trimw * trimh * 4;
-	file->cache[page].w = trimw;
-	file->cache[page].h = trimh;
-	file->cache[page].left = minx;
-	file->cache[page].right = w - maxx;
-	file->cache[page].top = miny;
-	file->cache[page].bottom = h -maxy;
+static void window(u32 * const from, u32 * const to) {
 
-	file->cache[page].size = outlen;
-	file->cache[page].data = dst;
+	// In lazy mode, the pages worth having: a screenful behind the view
+	// and two ahead, in the direction the user is scrolling.
+	const u32 first = __sync_fetch_and_add(&file->first_visible, 0);
+	const u32 last = __sync_fetch_and_add(&file->last_visible, 0);
+
+	if (!lazy) {
+		*from = 0;
+		*to = file->pages - 1;
+		return;
+	}
+
+	const u32 span = last - first + 1;
+	u32 before = span, after = span * 2;
+	if (file->direction < 0) {
+		before = span * 2;
+		after = span;
+	}
+
+	*from = first > before ? first - before : 0;
+	*to = last + after < file->pages ? last + after : file->pages - 1;
 }
 
-static void dopage(const u32 page) {
+static void droplevel(cachedpage * const cur, const u8 lvl) {
 
-	struct timeval start, end;
-	gettimeofday(&start, NULL);
+	// Gone until the page comes near the view again
+	pagelevel * const l = &cur->level[lvl];
 
-	SplashColor white = { 255, 255, 255 };
-	SplashOutputDev *splash = new SplashOutputDev(splashModeXBGR8, 4, false, white);
-	splash->startDoc(file->pdf);
+	if (lvl == L_ZOOM) {
+		file->zoombytes -= l->size;
+		cur->zoomdpi = 0;
+	}
+	file->cachebytes -= l->size;
+
+	if (l->blocks && !l->inarena)
+		file->heaplevels--;
+	if (file->pins)
+		retire(l->blocks, l->numblocks, l->inarena);
+	else
+		freeblocks(l->blocks, l->numblocks, l->inarena);
+	l->blocks = NULL;
+	l->numblocks = 0;
+	l->inarena = false;
+	l->size = l->uncompressed = 0;
+	l->dpi = 0;
+	l->ready = false;
+	l->claimed = false;
+}
 
-	file->pdf->displayPage(splash, page + 1, 144, 144, 0, true, false, false);
+static bool overbudget(bool * const all) {
+	*all = lazy && __sync_fetch_and_add(&file->cachebytes, 0) > maxcache;
+	return *all || __sync_fetch_and_add(&file->zoombytes, 0) > ZOOM_BUDGET;
+}
 
-	gettimeofday(&end, NULL);
-	if (details > 1) {
-		printf("%u: rendering %u us\n", page, usecs(start, end));
-		start = end;
+static void evict() {
+
+	// Drop levels farthest from the viewport until within budget. The
+	// zoomed ones have a budget of their own, in lazy mode everything
+	// counts. Pages we'd want rendered right away are never dropped.
+	bool all;
+	if (!overbudget(&all))
+		return;
+
+	u32 from, to;
+	window(&from, &to);
+	if (!lazy) {
+		from = __sync_fetch_and_add(&file->first_visible, 0);
+		to = __sync_fetch_and_add(&file->last_visible, 0);
+	}
+
+	// Inwards from both ends of the document, whichever is farther from
+	// the view first. One pass, however much has to go.
+	u32 lo = 0, hi = file->pages - 1, l;
+	pthread_mutex_lock(&file->lock);
+	while (overbudget(&all)) {
+		u32 far;
+		if (lo < from && (hi <= to || from - lo >= hi - to))
+			far = lo++;
+		else if (hi > to)
+			far = hi--;
+		else
+			break;
+
+		cachedpage * const cur = &file->cache[far];
+		for (l = 0; l < L_COUNT; l++) {
+			if (!cur->level[l].ready)
+				continue;
+			if (all || l == L_ZOOM)
+				droplevel(cur, l);
+		}
+	}
+	pthread_mutex_unlock(&file->lock);
+}
+
+static u64 rendertime, storetime;
+
+static renderworker *getworker() {
+
+	// Each thread opens its own copy of the file on first use, and keeps
+	// one output device for it, so Splash's font caches survive pages.
+	renderworker * const w = &file->workers[omp_get_thread_num()];
+	if (!w->pdf && shareddoc)
+		w->pdf = file->pdf;
+	if (!w->pdf) {
+		PDFDoc * const pdf = new PDFDoc(new GooString(file->name));
+		if (pdf->isOk()) {
+			w->pdf = pdf;
+		} else {
+			// Fall back to sharing the main one
+			delete pdf;
+			w->pdf = file->pdf;
+		}
 	}
 
-	SplashBitmap * const bm = splash->takeBitmap();
+	if (!w->splash) {
+		SplashColor white = { 255, 255, 255 };
+		w->splash = new SplashOutputDev(splashModeXBGR8, 4, false, white);
+		w->splash->startDoc(w->pdf);
+	}
 
-	store(bm, page);
+	return w;
+}
 
+static u32 lap(struct timeval * const start, u64 * const total) {
+	struct timeval end;
 	gettimeofday(&end, NULL);
-	if (details > 1) {
-		printf("%u: storing %u us\n", page, usecs(start, end));
-		start = end;
+
+	const u32 us = usecs(*start, end);
+	__sync_fetch_and_add(total, us);
+	*start = end;
+
+	return us;
+}
+
+static bool bigpage(PDFDoc * const pdf, const u32 page, const u16 dpi) {
+	// Before we know the margins, go by the media box
+	const double scale = dpi / 72.0;
+	return pdf->getPageMediaWidth(page + 1) * scale *
+		pdf->getPageMediaHeight(page + 1) * scale * 4 > TILE_LIMIT;
+}
+
+static bool tiled(const cachedpage * const cur, const u16 dpi) {
+	const double scale = dpi / (double) FULL_DPI;
+	return cur->w * scale * cur->h * scale * 4 > TILE_LIMIT;
+}
+
+static bool rendertiles(renderworker * const w, const u32 page, const u8 lvl,
+			const u16 dpi) {
+
+	// Render a band of tiles at a time, each band a Splash slice of the
+	// trimmed area, so no bitmap ever holds the whole page.
+	const cachedpage * const cur = &file->cache[page];
+	const double scale = dpi / (double) FULL_DPI;
+	const u32 sx = cur->left * scale;
+	const u32 sy = cur->top * scale;
+	const u32 tw = cur->w * scale;
+	const u32 th = cur->h * scale;
+	const u32 cols = (tw + TILE_SIZE - 1) / TILE_SIZE;
+	const u32 rows = (th + TILE_SIZE - 1) / TILE_SIZE;
+	u32 x, y, rendus = 0, storeus = 0;
+
+	const bool keep = pooled(lvl), mipkeep = pooled(L_FULL);
+	pageblock * const blocks = newblocks(w, keep, cols * rows);
+	pageblock *mipblocks[MIP_LEVELS] = { NULL };
+	u32 nummip[MIP_LEVELS] = { 0 }, i;
+	if (lvl == L_FULL) {
+		for (i = 0; i < MIP_LEVELS; i++)
+			mipblocks[i] = newblocks(w, mipkeep, cols * rows);
+	}
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	for (y = 0; y < rows; y++) {
+		const u32 bandy = y * TILE_SIZE;
+		const u32 bandh = th - bandy < TILE_SIZE ? th - bandy : TILE_SIZE;
+
+		w->pdf->displayPageSlice(w->splash, page + 1, dpi, dpi, 0,
+					true, false, false,
+					sx, sy + bandy, tw, bandh,
+					abortcheck);
+		if (cancelled()) {
+			freeblocks(blocks, cols * rows, keep);
+			for (i = 0; i < MIP_LEVELS; i++) {
+				if (mipblocks[i])
+					freeblocks(mipblocks[i], nummip[i], mipkeep);
+			}
+			return false;
+		}
+		rendus += lap(&start, &rendertime);
+
+		SplashBitmap * const bm = w->splash->getBitmap();
+		const u8 * const src = bm->getDataPtr();
+		const u32 rowsize = bm->getRowSize();
+
+		for (x = 0; x < cols; x++) {
+			pageblock * const b = &blocks[y * cols + x];
+			b->x = x * TILE_SIZE;
+			b->y = bandy;
+			const u32 tilew = tw - b->x < TILE_SIZE ? tw - b->x : TILE_SIZE;
+			compress(w, keep, src + b->x * 4, rowsize,
+				tilew, bandh, pickcodec(lvl), b);
+			if (lvl == L_FULL)
+				miptile(w, src + b->x * 4, rowsize, tilew, bandh,
+					b->x, bandy, mipblocks, nummip);
+		}
+		storeus += lap(&start, &storetime);
+	}
+
+	publish(page, lvl, dpi, blocks, cols * rows, keep, tw, th);
+	for (i = 0; i < MIP_LEVELS && lvl == L_FULL; i++) {
+		if (!nummip[i]) {
+			if (!mipkeep)
+				free(mipblocks[i]);
+			continue;
+		}
+		publish(page, miplvls[i], mipdpis[i], mipblocks[i], nummip[i],
+			mipkeep, tw >> (i + 1), th >> (i + 1));
+		mipped(page, miplvls[i]);
+	}
+
+	if (details > 1)
+		printf("%u: %u tiles at %u dpi, rendering %u us, storing %u us\n",
+			page, cols * rows, dpi, rendus, storeus);
+
+	return true;
+}
+
+static bool render(renderworker * const w, const u32 page, const u8 lvl,
+			const u16 dpi) {
+
+	const cachedpage * const cur = &file->cache[page];
+
+	// Once the margins are known, very large pages go in tiles
+	if (lvl != L_PREVIEW && (cur->ready || cur->bbox == BB_OK) &&
+		tiled(cur, dpi))
+		return rendertiles(w, page, lvl, dpi);
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	// The bitmap stays owned by the device, and is reused for the next
+	// page when the size matches.
+	if (lvl == L_ZOOM) {
+		// Only the trimmed area, at the size it's shown at
+		const float scale = dpi / (float) FULL_DPI;
+		w->pdf->displayPageSlice(w->splash, page + 1, dpi, dpi, 0,
+					true, false, false,
+					cur->left * scale, cur->top * scale,
+					cur->w * scale, cur->h * scale,
+					abortcheck);
+	} else {
+		w->pdf->displayPage(w->splash, page + 1, dpi, dpi, 0,
+					true, false, false, abortcheck);
+	}
+
+	// A half-drawn page is useless
+	if (cancelled())
+		return false;
+
+	u32 us = lap(&start, &rendertime);
+	if (details > 1)
+		printf("%u: rendering at %u dpi %u us\n", page, dpi, us);
+
+	store(w, w->splash->getBitmap(), page, lvl, dpi);
+
+	us = lap(&start, &storetime);
+	if (details > 1)
+		printf("%u: storing at %u dpi %u us\n", page, dpi, us);
+
+	return true;
+}
+
+static void previewed() {
+	// A big page's full render may be waiting for the margins. No new
+	// jobs, so the idle threads go back to sleep.
+	pthread_mutex_lock(&file->lock);
+	pthread_cond_broadcast(&file->wake);
+	pthread_mutex_unlock(&file->lock);
+}
+
+static void dopage(const u32 page, const u8 lvl) {
+
+	if (cancelled())
+		return;
+
+	renderworker * const w = getworker();
+	cachedpage * const cur = &file->cache[page];
+	u16 dpi = FULL_DPI;
+
+	if (lvl == J_BOUNDS) {
+		bound(w, page);
+		return;
+	}
+
+	// The full render can skip its margin scan, and a big page its
+	// forced preview. A preview is wanted quickly, it leaves the bounds
+	// to their pass.
+	if (lvl == L_FULL)
+		bound(w, page);
+
+	if (lvl == L_PREVIEW) {
+		dpi = PREVIEW_DPI;
+	} else if (lvl == L_ZOOM) {
+		dpi = cur->zoomdpi;
+
+		// The view changed its mind
+		if (!dpi) {
+			__sync_bool_compare_and_swap(&cur->level[lvl].claimed, 1, 0);
+			return;
+		}
+	}
+
+	// Tiles cover the trimmed area, so a very large page needs its
+	// margins first. The preview finds them cheaply, if the drawing
+	// operations didn't.
+	if (lvl == L_FULL && !cur->ready && cur->bbox != BB_OK &&
+		bigpage(w->pdf, page, dpi)) {
+		if (__sync_bool_compare_and_swap(&cur->level[L_PREVIEW].claimed,
+							0, 1)) {
+			if (!render(w, page, L_PREVIEW, PREVIEW_DPI))
+				return;
+			__sync_bool_compare_and_swap(&cur->level[L_PREVIEW].ready, 0, 1);
+			__sync_bool_compare_and_swap(&cur->ready, 0, 1);
+			touched(page);
+			previewed();
+		} else {
+			// Another thread has the preview on its way
+			pthread_mutex_lock(&file->lock);
+			while (!cur->ready && cur->level[L_PREVIEW].claimed &&
+				!cancelled())
+				pthread_cond_wait(&file->wake, &file->lock);
+			pthread_mutex_unlock(&file->lock);
+			if (cancelled())
+				return;
+		}
 	}
 
-	delete bm;
-	delete splash;
+	if (!render(w, page, lvl, dpi))
+		return;
+
+	__sync_bool_compare_and_swap(&cur->level[lvl].ready, 0, 1);
+	__sync_bool_compare_and_swap(&cur->ready, 0, 1);
+	touched(page);
+
+	if (lvl == L_PREVIEW)
+		previewed();
 
-	__sync_bool_compare_and_swap(&file->cache[page].ready, 0, 1);
+	// Zoomed levels get redone whenever the zoom changes
+	if (lvl == L_ZOOM)
+		__sync_bool_compare_and_swap(&cur->level[lvl].claimed, 1, 0);
+
+	evict();
 
 	// If this page was visible, tell the app to refresh
 	const u32 first = __sync_fetch_and_add(&file->first_visible, 0);
@@ -172,76 +824,351 @@ static void dopage(const u32 page) {
 	}
 }
 
-static bool notdone(const bool arr[], const u32 num) {
+static bool claim(const u32 page, const u8 lvl) {
+	const cachedpage * const cur = &file->cache[page];
+	pagelevel * const l = &file->cache[page].level[lvl];
+	if (l->claimed)
+		return false;
+
+	// No point in a preview once the real thing is on its way
+	if (lvl == L_PREVIEW && cur->level[L_FULL].claimed)
+		return false;
+
+	// Zooming needs the final margins, and something to change
+	if (lvl == L_ZOOM) {
+		if (!cur->zoomdpi || !cur->level[L_FULL].ready)
+			return false;
+		if (l->ready && l->dpi == cur->zoomdpi)
+			return false;
+	}
+
+	return __sync_bool_compare_and_swap(&l->claimed, 0, 1);
+}
+
+static bool pick(const u32 first, const u32 from, const u32 to,
+			const u8 lvl, u32 * const page) {
+
+	// Onwards from the viewport, then backwards from it, nearest first
 	u32 i;
-	for (i = 0; i < num; i++) {
-		if (!arr[i])
+	for (i = first; i <= to; i++) {
+		if (claim(i, lvl)) {
+			*page = i;
 			return true;
+		}
+	}
+
+	for (i = first; i > from; i--) {
+		if (claim(i - 1, lvl)) {
+			*page = i - 1;
+			return true;
+		}
 	}
+
 	return false;
 }
 
-static void *renderer(void *) {
+static bool nextjob(u32 * const page, u8 * const lvl) {
 
-	// Optional timing
-	struct timeval start, end;
-	gettimeofday(&start, NULL);
+	// The visible pages get a preview, then full resolution, and then
+	// a render at the size they're shown at. After that every page gets
+	// a preview, so a far jump shows something at once, and finally the
+	// rest are done properly. Re-read every time, so a jump takes effect
+	// on the very next job any thread picks up. In lazy mode, "every
+	// page" is only the window around the view.
+	static const u8 visible[] = { L_PREVIEW, L_FULL, L_ZOOM };
+	static const u8 rest[] = { L_PREVIEW, L_FULL };
+	const u32 first = __sync_fetch_and_add(&file->first_visible, 0);
+	const u32 last = __sync_fetch_and_add(&file->last_visible, 0);
+	u32 i, p, from, to;
 
-	const u32 chunksize = omp_get_num_procs() * 3;
+	if (cancelled())
+		return false;
 
-	if (file->pages < chunksize) {
-		#pragma omp parallel for schedule(guided)
-		for (u32 i = 1; i < file->pages; i++) {
-			dopage(i);
+	for (p = 0; p < sizeof(visible); p++) {
+		for (i = first; i <= last && i < file->pages; i++) {
+			if (claim(i, visible[p])) {
+				*page = i;
+				*lvl = visible[p];
+				return true;
+			}
 		}
-	} else {
-		// With a lot of pages, the user may want to go far before things
-		// are fully loaded, say to page 500. Render in chunks and adapt.
-
-		u32 c;
-		const u32 chunks = file->pages / chunksize;
-		const u32 remainder = file->pages % chunksize;
-
-		bool done[chunks];
-		memset(done, 0, sizeof(bool) * chunks);
-
-		while (notdone(done, chunks)) {
-			for (c = 0; c < chunks; c++) {
-
-				// Did the user skip around?
-				const u32 first = __sync_fetch_and_add(&file->first_visible, 0);
-				if (first) {
-					const u32 tmp = file->first_visible / chunksize;
-					if (tmp < chunks && !done[tmp])
-						c = tmp;
-				}
-
-				const u32 max = (c + 1) * chunksize;
-				if (done[c]) continue;
-				#pragma omp parallel for schedule(guided)
-				for (u32 i = c * chunksize; i < max; i++) {
-					dopage(i);
-				}
-				done[c] = true;
+	}
+
+	// Then the bounds of every page, so the layout gets its final size
+	// long before the pixels. Lazy mode bounds only what it renders.
+	if (!lazy && file->boundnext < file->pages) {
+		i = __sync_fetch_and_add(&file->boundnext, 1);
+		if (i < file->pages) {
+			*page = i;
+			*lvl = J_BOUNDS;
+			return true;
+		}
+	}
+
+	window(&from, &to);
+	for (p = 0; p < sizeof(rest); p++) {
+		if (pick(first, from, to, rest[p], page)) {
+			*lvl = rest[p];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void wakeworkers() {
+	pthread_mutex_lock(&file->lock);
+	file->jobgen++;
+	pthread_cond_broadcast(&file->wake);
+	pthread_mutex_unlock(&file->lock);
+}
+
+void dropdamaged(const u32 page, const u8 lvl, const u16 dpi) {
+
+	// A level from the disk cache that doesn't decode. It and the rest
+	// that came with it get rendered again.
+	cachedpage * const cur = &file->cache[page];
+	static const u8 saved[] = { L_FULL, L_HALF, L_PREVIEW };
+	u32 i;
+
+	diskdamaged();
+
+	pthread_mutex_lock(&file->lock);
+	if (cur->level[lvl].ready && cur->level[lvl].dpi == dpi) {
+		for (i = 0; i < sizeof(saved); i++) {
+			pagelevel * const l = &cur->level[saved[i]];
+			if (l->ready && l->numblocks &&
+				diskbacked(l->blocks[0].data))
+				droplevel(cur, saved[i]);
+		}
+	}
+	pthread_mutex_unlock(&file->lock);
+
+	wakeworkers();
+}
+
+void requestdpi(const u32 page, const u16 dpi) {
+
+	// Called by the view for visible pages once the zoom settles
+	if (file->cache[page].zoomdpi == dpi)
+		return;
+
+	file->cache[page].zoomdpi = dpi;
+	if (dpi)
+		wakeworkers();
+}
+
+void viewmoved(const u32 prevfirst) {
+
+	// Lazy mode renders around the view, so it has new work now
+	file->direction = file->first_visible > prevfirst ? 1 : -1;
+	if (lazy)
+		wakeworkers();
+}
+
+static void serve(const bool wait) {
+
+	// Every thread keeps pulling the most urgent unclaimed job,
+	// so nobody waits on a chunk barrier.
+	u32 page;
+	u8 lvl;
+
+	while (!cancelled()) {
+		pthread_mutex_lock(&file->lock);
+		const u32 gen = file->jobgen;
+		pthread_mutex_unlock(&file->lock);
+
+		while (nextjob(&page, &lvl))
+			dopage(page, lvl);
+
+		if (!wait)
+			break;
+
+		// Sleep until the view asks for something new
+		pthread_mutex_lock(&file->lock);
+		while (gen == file->jobgen && !cancelled())
+			pthread_cond_wait(&file->wake, &file->lock);
+		pthread_mutex_unlock(&file->lock);
+	}
+}
+
+static void codecbench() {
+
+	// Every codec on the same pixels: the full levels as rendered
+	u64 raw = 0, packed[C_COUNT] = { 0 }, enc[C_COUNT] = { 0 },
+		dec[C_COUNT] = { 0 };
+	u32 i, j, pages = 0;
+	u8 c;
+
+	for (i = 0; i < file->pages; i++) {
+		for (j = 0; ; j++) {
+			pthread_mutex_lock(&file->lock);
+			const pagelevel * const l = &file->cache[i].level[L_FULL];
+			if (!l->ready || j >= l->numblocks) {
+				pthread_mutex_unlock(&file->lock);
+				break;
+			}
+
+			const pageblock * const b = &l->blocks[j];
+			const u32 len = planesize(b->format, b->w, b->h);
+			u8 * const pixels = (u8 *) xmalloc(len);
+			const bool ok = decode(b->codec, b->data, b->size,
+						pixels, len);
+			const bool disk = diskbacked(b->data);
+			pthread_mutex_unlock(&file->lock);
+
+			// Leave a damaged cache file's pages out
+			if (!ok && !disk)
+				die(_("Error decompressing\n"));
+			if (!ok) {
+				free(pixels);
+				break;
+			}
+
+			if (!j)
+				pages++;
+			raw += len;
+
+			u8 * const out = (u8 *) xmalloc(len);
+			for (c = 0; c < C_COUNT; c++) {
+				if (!codecavail(c))
+					continue;
+
+				const u32 cap = codecbound(c, len, 1);
+				u8 * const tmp = (u8 *) xmalloc(cap);
+
+				struct timeval start;
+				gettimeofday(&start, NULL);
+				const u32 size = encode(c, pixels, len, tmp, cap);
+				lap(&start, &enc[c]);
+
+				if (!decode(c, tmp, size, out, len))
+					die(_("Error decompressing\n"));
+				lap(&start, &dec[c]);
+
+				packed[c] += size;
+				free(tmp);
 			}
+
+			free(out);
+			free(pixels);
 		}
+	}
 
-		#pragma omp parallel for schedule(guided)
-		for (c = 0; c < remainder; c++) {
-			dopage(c + chunks * chunksize);
+	if (!pages || !raw)
+		return;
+
+	printf(_("Codecs on %u pages, %.2fmb before compression:\n"), pages,
+		raw / 1024 / 1024.0f);
+	for (c = 0; c < C_COUNT; c++) {
+		if (!codecavail(c)) {
+			printf(_("%8s: not built in\n"), codecname(c));
+			continue;
 		}
+		printf(_("%8s: %.2f%%, per page compress %.0f us, "
+			"decompress %.0f us\n"), codecname(c),
+			100 * packed[c] / (float) raw,
+			enc[c] / (float) pages, dec[c] / (float) pages);
 	}
+}
+
+static u64 devicepass(const u32 pages, const bool reuse) {
+
+	// The first pages at full resolution on one thread, from a fresh
+	// document so neither pass inherits the other's caches
+	PDFDoc * const pdf = new PDFDoc(new GooString(file->name));
+	if (!pdf->isOk()) {
+		delete pdf;
+		return 0;
+	}
+
+	SplashColor white = { 255, 255, 255 };
+	SplashOutputDev *dev = NULL;
+	u64 total = 0;
+	u32 i;
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < pages; i++) {
+		if (!dev) {
+			dev = new SplashOutputDev(splashModeXBGR8, 4, false, white);
+			dev->startDoc(pdf);
+		}
+
+		pdf->displayPage(dev, i + 1, FULL_DPI, FULL_DPI, 0,
+					true, false, false, abortcheck);
+		if (cancelled())
+			break;
+
+		if (!reuse) {
+			delete dev;
+			dev = NULL;
+		}
+	}
+	lap(&start, &total);
+
+	delete dev;
+	delete pdf;
+	return i == pages ? total : 0;
+}
+
+static void devicebench() {
+
+	// Same pages both ways: a new output device and startDoc() for each
+	// page, against one kept for all of them
+	const u32 pages = devicepages < file->pages ? devicepages : file->pages;
+	const u64 fresh = devicepass(pages, false);
+	const u64 kept = devicepass(pages, true);
+	if (!fresh || !kept)
+		return;
+
+	printf(_("Rendering %u pages at %u dpi on one thread:\n"), pages,
+		FULL_DPI);
+	printf(_("  device per page: %.0f us per page\n"),
+		fresh / (float) pages);
+	printf(_("  device reused: %.0f us per page, %.1f%% faster\n"),
+		kept / (float) pages, 100 - 100 * kept / (float) fresh);
+}
+
+static void *renderer(void *) {
+
+	// Optional timing
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	// One team for the whole file
+	#pragma omp parallel num_threads(file->numworkers)
+	serve(false);
+
+	// A new file is being opened, it will take over from here
+	if (cancelled())
+		return NULL;
 
 	// Print stats
 	if (details) {
 		u32 total = 0, totalcomp = 0;
 		for (u32 i = 0; i < file->pages; i++) {
-			total += file->cache[i].uncompressed;
-			totalcomp += file->cache[i].size;
+			for (u32 l = 0; l < L_COUNT; l++) {
+				total += file->cache[i].level[l].uncompressed;
+				totalcomp += file->cache[i].level[l].size;
+			}
 		}
 
 		printf(_("Compressed mem usage %.2fmb, compressed to %.2f%%\n"),
 			totalcomp / 1024 / 1024.0f, 100 * totalcomp / (float) total);
+		printf(_("Arena chunks take %.2fmb\n"),
+			file->arena.bytes / 1024 / 1024.0f);
+
+		u32 docs = 0;
+		for (u32 i = 0; i < file->numworkers; i++) {
+			if (file->workers[i].pdf && file->workers[i].pdf != file->pdf)
+				docs++;
+		}
+		printf(_("Rendered with %u thread-private documents\n"), docs);
+
+		printf(_("Average per page: rendering %.0f us, storing %.0f us\n"),
+			rendertime / (float) file->pages,
+			storetime / (float) file->pages);
 
 		gettimeofday(&end, NULL);
 		const u32 us = usecs(start, end);
@@ -250,20 +1177,25 @@ static void *renderer(void *) {
 			us / 1000000.0f);
 	}
 
-	u32 maxw = 0, maxh = 0;
-	for (u32 i = 0; i < file->pages; i++) {
-		if (file->cache[i].w > maxw)
-			maxw = file->cache[i].w;
-		if (file->cache[i].h > maxh)
-			maxh = file->cache[i].h;
-	}
-	file->maxw = maxw;
-	file->maxh = maxh;
+	if (benchmark)
+		codecbench();
+	if (devicepages)
+		devicebench();
+
+	setmax();
 
 	// Set normal cursor
 	const u8 msg = MSG_READY;
 	swrite(writepipe, &msg, 1);
 
+	// Keep the pages for next time
+	disksave();
+
+	// Stay around for zoom changes and, in lazy mode, scrolling,
+	// until another file is opened
+	#pragma omp parallel num_threads(file->numworkers)
+	serve(true);
+
 	return NULL;
 }
 
@@ -302,21 +1234,54 @@ void loadfile(const char *file) {
 	}
 
 	if (::file->cache) {
-		// Free the old one
-		pthread_cancel(::file->tid);
+		// Free the old one. The render threads notice the flag
+		// between pages, and Poppler between drawing operations.
+		__sync_bool_compare_and_swap(&::file->cancel, 0, 1);
+		wakeworkers();
 		pthread_join(::file->tid, NULL);
-
+		prefetchstop();
+		::file->cancel = 0;
+		::file->zoombytes = 0;
+		::file->cachebytes = 0;
+		::file->direction = 0;
+		::file->boundnext = 0;
+
+		// The arena takes the kept levels with it, only zoomed and
+		// lazy ones are malloced
 		u32 i;
-		const u32 max = ::file->pages;
+		const u32 max = ::file->heaplevels ? ::file->pages : 0;
 		for (i = 0; i < max; i++) {
-			if (::file->cache[i].ready)
-				free(::file->cache[i].data);
+			for (u32 l = 0; l < L_COUNT; l++) {
+				const pagelevel * const lv = &::file->cache[i].level[l];
+				if (lv->blocks && !lv->inarena)
+					freeblocks(lv->blocks, lv->numblocks, false);
+			}
 		}
+		::file->heaplevels = 0;
 		free(::file->cache);
+		free(::file->dirty);
 		::file->cache = NULL;
+		::file->dirty = NULL;
+		arenafree(&::file->arena);
+		diskclose();
+
+		for (i = 0; i < ::file->numworkers; i++) {
+			free(::file->workers[i].packed);
+			free(::file->workers[i].out);
+			free(::file->workers[i].mip[0]);
+			free(::file->workers[i].mip[1]);
+			delete ::file->workers[i].splash;
+			if (::file->workers[i].pdf != ::file->pdf)
+				delete ::file->workers[i].pdf;
+		}
+		free(::file->workers);
+		free(::file->name);
+		::file->workers = NULL;
+		::file->name = NULL;
 	}
 
 	::file->pdf = pdf;
+	::file->name = strdup(file);
 	::file->pages = pdf->getNumPages();
 	::file->maxw = ::file->maxh = ::file->first_visible = ::file->last_visible = 0;
 
@@ -326,14 +1291,52 @@ void loadfile(const char *file) {
 		return;
 	}
 
+	::file->loading = true;
 	fl_cursor(FL_CURSOR_WAIT);
 
 	::file->cache = (cachedpage *) xcalloc(::file->pages, sizeof(cachedpage));
+	::file->dirty = (u64 *) xcalloc((::file->pages + 63) / 64, sizeof(u64));
+
+	// Every page's size from the page tree, so the layout is right from
+	// the first frame. Older poppler loads the tree lazily without a
+	// lock, so this stays on one thread; it's cheap next to rendering.
+	u32 i;
+	for (i = 0; i < ::file->pages; i++) {
+		const double scale = FULL_DPI / 72.0;
+		double pw = pdf->getPageMediaWidth(i + 1) * scale;
+		double ph = pdf->getPageMediaHeight(i + 1) * scale;
+		const int rot = pdf->getPageRotate(i + 1);
+		if (rot == 90 || rot == 270) {
+			const double tmp = pw;
+			pw = ph;
+			ph = tmp;
+		}
+
+		// Same rounding as Splash
+		::file->cache[i].pagew = pw + 0.5;
+		::file->cache[i].pageh = ph + 0.5;
+	}
+
+	::file->numworkers = omp_get_max_threads();
+	::file->workers = (renderworker *) xcalloc(::file->numworkers,
+							sizeof(renderworker));
 
 	if (!globalParams)
 		globalParams = new GlobalParams;
 
-	dopage(0);
+	rendertime = storetime = 0;
+
+	// A previous run may have done the work already
+	const u32 saved = diskload();
+	if (details && saved)
+		printf(_("Loaded %u pages from the disk cache\n"), saved);
+	if (saved)
+		setmax();
+
+	if (!::file->cache[0].level[L_FULL].claimed) {
+		::file->cache[0].level[L_FULL].claimed = true;
+		dopage(0, L_FULL);
+	}
 
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
@@ -15,11 +15,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "main.h"
+#include "codec.h"
+#include "margins.h"
+#include "mip.h"
+#include "prefetch.h"
 #include "wmicon.h"
 #include "icons.h"
 #include <FL/Fl_File_Icon.H>
 #include <getopt.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 Fl_Double_Window *win = (Fl_Double_Window *) 0;
 static Fl_Pack *buttons = (Fl_Pack *) 0;
@@ -33,6 +39,13 @@ pdfview *view = NULL;
 int writepipe;
 
 u8 details = 0;
+u8 lazy = 0;
+u64 maxcache = 256 * 1024 * 1024;
+u64 maxdisk = 0;
+u8 doccodec = C_LZO;
+u8 benchmark = 0;
+u8 shareddoc = 0;
+u32 devicepages = 0;
 openfile *file = NULL;
 
 static Fl_Menu_Item menu_zoombar[] = {
@@ -120,8 +133,15 @@ static void reader(FL_SOCKET fd, void*) {
 			view->redraw();
 		break;
 		case MSG_READY:
+			file->loading = false;
 			fl_cursor(FL_CURSOR_DEFAULT);
 		break;
+		case MSG_LAYOUT:
+			view->relayout();
+		break;
+		case MSG_PREFETCH:
+			view->takeahead();
+		break;
 		default:
 			die(_("Unrecognized thread message\n"));
 	}
@@ -139,6 +159,24 @@ static void checkX() {
 		die(_("No XRender on this server\n"));
 }
 
+static u32 number(const char * const opt, const char * const arg) {
+	// A whole number, or the way to get the usage
+	char *end;
+	errno = 0;
+	const unsigned long n = strtoul(arg, &end, 10);
+	if (!isdigit((u8) arg[0]) || *end || errno || n > UINT_MAX)
+		die(_("Invalid number %s for --%s, see --help\n"), arg, opt);
+	return n;
+}
+
+static int selfcheck() {
+	// Every SIMD variant the CPU runs, against the plain loops
+	bool ok = checkmargins();
+	ok = checkhalve() && ok;
+	puts(ok ? _("Self-check passed") : _("Self-check failed"));
+	return ok ? 0 : 1;
+}
+
 static void selecting_changed(Fl_Widget *, void *) {
 	view->resetselection();
 	view->redraw();
@@ -155,21 +193,63 @@ int main(int argc, char **argv) {
 	#endif
 
 	const struct option opts[] = {
+		{"benchmark", 0, NULL, 'b'},
+		{"codec", 1, NULL, 'c'},
 		{"details", 0, NULL, 'd'},
+		{"device-bench", 1, NULL, 'r'},
+		{"disk-cache-mb", 1, NULL, 'D'},
 		{"help", 0, NULL, 'h'},
+		{"lazy", 0, NULL, 'l'},
+		{"max-cache-mb", 1, NULL, 'm'},
+		{"self-check", 0, NULL, 't'},
+		{"shared-doc", 0, NULL, 's'},
 		{"version", 0, NULL, 'v'},
 		{NULL, 0, NULL, 0}
 	};
 
 	while (1) {
-		const int c = getopt_long(argc, argv, "dhv", opts, NULL);
+		const int c = getopt_long(argc, argv, "bc:dD:hlm:r:stv", opts, NULL);
 		if (c == -1)
 			break;
 
 		switch (c) {
+			case 'b':
+				benchmark = 1;
+			break;
+			case 'c':
+				doccodec = findcodec(optarg);
+				if (doccodec == C_COUNT || !codecavail(doccodec))
+					die(_("Codec %s not available\n"), optarg);
+			break;
 			case 'd':
 				details++;
 			break;
+			case 'D':
+				maxdisk = (u64) number("disk-cache-mb", optarg) *
+						1024 * 1024;
+			break;
+			case 'm':
+				maxcache = (u64) number("max-cache-mb", optarg) *
+						1024 * 1024;
+				if (!maxcache)
+					die(_("Invalid cache size %s, see --help\n"),
+						optarg);
+				// Fall-through
+			case 'l':
+				lazy = 1;
+			break;
+			case 'r':
+				devicepages = number("device-bench", optarg);
+				if (!devicepages)
+					die(_("Invalid page count %s, see --help\n"),
+						optarg);
+			break;
+			case 's':
+				shareddoc = 1;
+			break;
+			case 't':
+				return selfcheck();
+			break;
 			case 'v':
 				printf("%s\n", PACKAGE_STRING);
 				return 0;
@@ -177,8 +257,17 @@ int main(int argc, char **argv) {
 			case 'h':
 			default:
 				printf(_("Usage: %s [options] file.pdf\n\n"
+					"	-b --benchmark	Compare the codecs on the rendered pages\n"
+					"	-c --codec name	Compress pages with lzo, lzo999, lz4 or zstd\n"
 					"	-d --details	Print RAM, timing details (use twice for more)\n"
+					"	-D --disk-cache-mb n	Keep rendered pages in $XDG_CACHE_HOME/flaxpdf between runs,\n"
+					"				up to n MB for all files (off by default)\n"
 					"	-h --help	This help\n"
+					"	-l --lazy	Only render pages near the view\n"
+					"	-m --max-cache-mb n	Memory for rendered pages in lazy mode (implies -l)\n"
+					"	-r --device-bench n	Time n pages with a new output device per page vs one reused\n"
+					"	-s --shared-doc	Render from one document on all threads, to compare timings\n"
+					"	-t --self-check	Check the optimized pixel loops against the plain ones\n"
 					"	-v --version	Print version\n"),
 					argv[0]);
 				return 0;
@@ -190,6 +279,9 @@ int main(int argc, char **argv) {
 	Fl_File_Icon::load_system_icons();
 
 	file = (openfile *) xcalloc(1, sizeof(openfile));
+	pthread_mutex_init(&file->lock, NULL);
+	pthread_cond_init(&file->wake, NULL);
+	arenainit(&file->arena);
 	int ptmp[2];
 	if (pipe(ptmp))
 		die(_("Failed in pipe()\n"));
@@ -287,5 +379,9 @@ int main(int argc, char **argv) {
 
 	view->take_focus();
 
-	return Fl::run();
+	const int ret = Fl::run();
+	prefetchquit();
+	view->stats();
+
+	return ret;
 }
@@ -45,6 +45,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "lrtypes.h"
 #include "macros.h"
 #include "helpers.h"
+#include "arena.h"
 #include "view.h"
 
 extern Fl_Double_Window *win;
@@ -53,22 +54,105 @@ extern Fl_Input *pagebox;
 extern Fl_Input_Choice *zoombar;
 extern Fl_Light_Button *selecting;
 extern u8 details;
+extern u8 lazy;
+extern u64 maxcache;
+extern u64 maxdisk;
+extern u8 doccodec;
+extern u8 benchmark;
+extern u8 shareddoc;
+extern u32 devicepages;
 
 extern int writepipe;
 
 void loadfile(const char *);
+void requestdpi(const u32 page, const u16 dpi);
+void viewmoved(const u32 prevfirst);
+void pinblocks();
+void unpinblocks();
+void dropdamaged(const u32 page, const u8 lvl, const u16 dpi);
+
+#define FULL_DPI 144
+#define HALF_DPI (FULL_DPI / 2)
+#define PREVIEW_DPI (FULL_DPI / 4)
+#define MAX_ZOOM_DPI (FULL_DPI * 3)
+
+enum levelid {
+	L_FULL = 0,
+	L_PREVIEW,
+	L_ZOOM,
+	L_HALF,
+	L_COUNT
+};
 
-struct cachedpage {
+// A rectangle of a level, compressed on its own
+struct pageblock {
 	u8 *data;
 	u32 size;
+
+	u32 x, y, w, h;
+
+	// Written with, see codec.h, and the pixel layout, see planes.h
+	u8 codec;
+	u8 format;
+
+	// Data is malloced, not in the arena or the disk cache
+	bool owned;
+};
+
+// One raster of a page, trimmed at its own resolution. Split into
+// row strips, or for very large pages into tiles.
+struct pagelevel {
+	pageblock *blocks;
+	u32 numblocks;
+	u32 size;
 	u32 uncompressed;
 
+	u32 w, h;
+	u16 dpi;
+
+	bool ready;
+	bool claimed;
+	// The blocks array is in the arena, not malloced
+	bool inarena;
+};
+
+// Replaced while pinned, freed by the last reader
+struct retiredblocks {
+	pageblock *blocks;
+	u32 num;
+	bool inarena;
+	retiredblocks *next;
+};
+
+struct cachedpage {
+	pagelevel level[L_COUNT];
+
+	// Trimmed size and margins, always at FULL_DPI
 	u32 w, h;
 	u16 left, right, top, bottom;
 
+	// Untrimmed size from the page tree, known before rendering
+	u32 pagew, pageh;
+
+	// Resolution the view wants L_ZOOM in, 0 for none
+	u16 zoomdpi;
+
+	// Whether the margins came from the drawing operations
+	u8 bbox;
+
+	// Whether they came from the full level's pixels. Those stay even
+	// when the level is dropped.
+	bool exact;
+
 	bool ready;
 };
 
+enum bboxstate {
+	BB_UNKNOWN = 0,
+	BB_NONE,
+	BB_OK
+};
+
 enum zoommode {
 	Z_TRIM = 0,
 	Z_PAGE,
@@ -78,22 +162,84 @@ enum zoommode {
 
 enum msg {
 	MSG_REFRESH = 0,
-	MSG_READY
+	MSG_READY,
+	MSG_LAYOUT,
+	MSG_PREFETCH
+};
+
+class SplashOutputDev;
+
+// Each render thread parses the file through its own PDFDoc,
+// so they don't serialize on one XRef and lexer.
+struct renderworker {
+	PDFDoc *pdf;
+	SplashOutputDev *splash;
+
+	// This thread's part of the arena
+	u8 *bump;
+	u32 room;
+
+	// Reused for every block: the trimmed pixels when they can't be
+	// compressed in place, and the compressed output before its copy
+	u8 *packed, *out;
+	u32 packedsize, outsize;
+
+	// The halved bitmaps a full render's smaller levels come from
+	u8 *mip[2];
+	u32 mipsize[2];
 };
 
 struct openfile {
 	cachedpage *cache;
 	PDFDoc *pdf;
+	char *name;
+
+	renderworker *workers;
+	u32 numworkers;
+
 	u32 maxw, maxh;
 
+	// Until the renderers are done with the whole file. Main thread
+	// only, MSG_READY clears it.
+	bool loading;
+
 	u32 pages;
 
 	u32 first_visible;
 	u32 last_visible;
+	s8 direction;
 
 	float zoom;
 	zoommode mode;
 	pthread_t tid;
+	u8 cancel;
+
+	// Guards replacing levels against the view reading them,
+	// and wakes idle render threads when there's new work
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	u32 jobgen;
+	u64 zoombytes;
+	u64 cachebytes;
+
+	// Readers decoding blocks with the lock released. Levels replaced
+	// meanwhile wait on the list until the last one is done.
+	u32 pins;
+	retiredblocks *retired;
+
+	// Pages handed out to the bounds pass
+	u32 boundnext;
+
+	// A bit per page whose height the view hasn't caught up with,
+	// and a counter so it needn't look when nothing changed
+	u64 *dirty;
+	u32 geomgen;
+
+	// Backs the levels kept for the whole document. The levels whose
+	// blocks array is malloced are counted, at close only those need
+	// looking at.
+	struct arena arena;
+	u32 heaplevels;
 };
 
 extern openfile *file;
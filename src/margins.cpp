@@ -0,0 +1,300 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "margins.h"
+#include "helpers.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MARGINS_X86 1
+#include <immintrin.h>
+#endif
+
+static bool nonwhite(const u8 * const pixel) {
+
+	return pixel[0] != 255 ||
+		pixel[1] != 255 ||
+		pixel[2] != 255;
+}
+
+void getmargins_ref(const u8 * const src, const u32 w, const u32 h,
+			const u32 rowsize, u32 *minx, u32 *maxx,
+			u32 *miny, u32 *maxy) {
+
+	int i, j;
+
+	bool found = false;
+	for (i = 0; i < (int) w && !found; i++) {
+		for (j = 0; j < (int) h && !found; j++) {
+			const u8 * const pixel = src + j * rowsize + i * 4;
+			if (nonwhite(pixel)) {
+				found = true;
+				*minx = i;
+			}
+		}
+	}
+
+	found = false;
+	for (j = 0; j < (int) h && !found; j++) {
+		for (i = *minx; i < (int) w && !found; i++) {
+			const u8 * const pixel = src + j * rowsize + i * 4;
+			if (nonwhite(pixel)) {
+				found = true;
+				*miny = j;
+			}
+		}
+	}
+
+	const int startx = *minx, starty = *miny;
+
+	found = false;
+	for (i = w - 1; i >= startx && !found; i--) {
+		for (j = h - 1; j >= starty && !found; j--) {
+			const u8 * const pixel = src + j * rowsize + i * 4;
+			if (nonwhite(pixel)) {
+				found = true;
+				*maxx = i;
+			}
+		}
+	}
+
+	found = false;
+	for (j = h - 1; j >= starty && !found; j--) {
+		for (i = *maxx; i >= startx && !found; i--) {
+			const u8 * const pixel = src + j * rowsize + i * 4;
+			if (nonwhite(pixel)) {
+				found = true;
+				*maxy = j;
+			}
+		}
+	}
+}
+
+// Row kernels. first() returns the index of the first non-white pixel,
+// or n if none; last() returns one past the last one, or 0 if none.
+// A pixel is white when its 32-bit word, ignoring the X byte, is all ones.
+
+struct marginops {
+	u32 (*first)(const u8 * const row, const u32 n);
+	u32 (*last)(const u8 * const row, const u32 n);
+};
+
+static u32 first_c(const u8 * const row, const u32 n) {
+	u32 i;
+	for (i = 0; i < n; i++) {
+		if (nonwhite(row + i * 4))
+			return i;
+	}
+	return n;
+}
+
+static u32 last_c(const u8 * const row, const u32 n) {
+	u32 i;
+	for (i = n; i > 0; i--) {
+		if (nonwhite(row + (i - 1) * 4))
+			return i;
+	}
+	return 0;
+}
+
+static const marginops ops_c = { first_c, last_c };
+
+#ifdef MARGINS_X86
+
+__attribute__ ((target("sse2")))
+static u32 first_sse2(const u8 * const row, const u32 n) {
+	const __m128i xmask = _mm_set1_epi32(0xff000000);
+	const __m128i white = _mm_set1_epi32(-1);
+	u32 i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (row + i * 4));
+		v = _mm_or_si128(v, xmask);
+		const u32 m = _mm_movemask_epi8(_mm_cmpeq_epi32(v, white)) ^ 0xffff;
+		if (m)
+			return i + __builtin_ctz(m) / 4;
+	}
+
+	return i + first_c(row + i * 4, n - i);
+}
+
+__attribute__ ((target("sse2")))
+static u32 last_sse2(const u8 * const row, const u32 n) {
+	const __m128i xmask = _mm_set1_epi32(0xff000000);
+	const __m128i white = _mm_set1_epi32(-1);
+	u32 i;
+
+	for (i = n; i >= 4; i -= 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (row + (i - 4) * 4));
+		v = _mm_or_si128(v, xmask);
+		const u32 m = _mm_movemask_epi8(_mm_cmpeq_epi32(v, white)) ^ 0xffff;
+		if (m)
+			return i - 4 + (31 - __builtin_clz(m)) / 4 + 1;
+	}
+
+	return last_c(row, i);
+}
+
+__attribute__ ((target("avx2")))
+static u32 first_avx2(const u8 * const row, const u32 n) {
+	const __m256i xmask = _mm256_set1_epi32(0xff000000);
+	const __m256i white = _mm256_set1_epi32(-1);
+	u32 i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (row + i * 4));
+		v = _mm256_or_si256(v, xmask);
+		const u32 m = ~(u32) _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, white));
+		if (m)
+			return i + __builtin_ctz(m) / 4;
+	}
+
+	return i + first_c(row + i * 4, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static u32 last_avx2(const u8 * const row, const u32 n) {
+	const __m256i xmask = _mm256_set1_epi32(0xff000000);
+	const __m256i white = _mm256_set1_epi32(-1);
+	u32 i;
+
+	for (i = n; i >= 8; i -= 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (row + (i - 8) * 4));
+		v = _mm256_or_si256(v, xmask);
+		const u32 m = ~(u32) _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, white));
+		if (m)
+			return i - 8 + (31 - __builtin_clz(m)) / 4 + 1;
+	}
+
+	return last_c(row, i);
+}
+
+static const marginops ops_sse2 = { first_sse2, last_sse2 };
+static const marginops ops_avx2 = { first_avx2, last_avx2 };
+
+#endif // MARGINS_X86
+
+static const marginops *pickops() {
+#ifdef MARGINS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &ops_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return &ops_sse2;
+#endif
+	return &ops_c;
+}
+
+static void scan(const marginops * const ops, const u8 * const src,
+			const u32 w, const u32 h, const u32 rowsize,
+			u32 *minx, u32 *maxx, u32 *miny, u32 *maxy) {
+
+	u32 top, bottom, j;
+
+	// Row-major all the way, whole rows at a time for the top and bottom
+	for (top = 0; top < h; top++) {
+		if (ops->first(src + top * rowsize, w) < w)
+			break;
+	}
+
+	// All white, keep the defaults
+	if (top == h)
+		return;
+
+	for (bottom = h; bottom > top + 1; bottom--) {
+		if (ops->first(src + (bottom - 1) * rowsize, w) < w)
+			break;
+	}
+
+	// In between, only the part outside the bounds found so far
+	// needs looking at.
+	u32 left = w, right = 0;
+	for (j = top; j < bottom; j++) {
+		const u8 * const row = src + j * rowsize;
+
+		if (left)
+			left = ops->first(row, left);
+		if (right < w)
+			right += ops->last(row + right * 4, w - right);
+	}
+
+	*minx = left;
+	*maxx = right - 1;
+	*miny = top;
+	*maxy = bottom - 1;
+}
+
+void getmargins(const u8 * const src, const u32 w, const u32 h,
+		const u32 rowsize, u32 *minx, u32 *maxx,
+		u32 *miny, u32 *maxy) {
+
+	static const marginops * const ops = pickops();
+	scan(ops, src, w, h, rowsize, minx, maxx, miny, maxy);
+}
+
+bool checkmargins() {
+
+	// Every variant this CPU can run, on random sizes and strides. A few
+	// dark pixels on white, the X byte left random, and now and then an
+	// all-white bitmap.
+	const marginops *ops[3] = { &ops_c };
+	u32 numops = 1, i, k;
+#ifdef MARGINS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		ops[numops++] = &ops_sse2;
+	if (__builtin_cpu_supports("avx2"))
+		ops[numops++] = &ops_avx2;
+#endif
+
+	unsigned seed = 1;
+	bool ok = true;
+	for (i = 0; i < 500 && ok; i++) {
+		const u32 w = 1 + rand_r(&seed) % 200;
+		const u32 h = 1 + rand_r(&seed) % 60;
+		const u32 rowsize = (w + rand_r(&seed) % 4) * 4;
+		u8 * const src = (u8 *) xmalloc(rowsize * h);
+		memset(src, 255, rowsize * h);
+
+		const u32 dots = rand_r(&seed) % 5;
+		for (k = 0; k < rowsize * h / 4; k++)
+			src[k * 4 + 3] = rand_r(&seed);
+		for (k = 0; k < dots; k++) {
+			const u32 x = rand_r(&seed) % w, y = rand_r(&seed) % h;
+			src[y * rowsize + x * 4 + rand_r(&seed) % 3] = rand_r(&seed) % 255;
+		}
+
+		u32 ref[4] = { 0, w - 1, 0, h - 1 };
+		getmargins_ref(src, w, h, rowsize, &ref[0], &ref[1], &ref[2], &ref[3]);
+
+		for (k = 0; k < numops; k++) {
+			u32 got[4] = { 0, w - 1, 0, h - 1 };
+			scan(ops[k], src, w, h, rowsize,
+				&got[0], &got[1], &got[2], &got[3]);
+			if (memcmp(got, ref, sizeof(ref))) {
+				printf("margins variant %u: %ux%u stride %u, "
+					"%u %u %u %u, should be %u %u %u %u\n",
+					k, w, h, rowsize, got[0], got[1], got[2],
+					got[3], ref[0], ref[1], ref[2], ref[3]);
+				ok = false;
+			}
+		}
+
+		free(src);
+	}
+
+	return ok;
+}
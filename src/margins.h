@@ -0,0 +1,37 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MARGINS_H
+#define MARGINS_H
+
+#include "lrtypes.h"
+
+// Bounds of the non-white area of an XBGR8 bitmap. An all-white bitmap
+// leaves them at the full size.
+void getmargins(const u8 * const src, const u32 w, const u32 h,
+		const u32 rowsize, u32 *minx, u32 *maxx,
+		u32 *miny, u32 *maxy);
+
+// The plain column-major scan, kept to check the others against
+void getmargins_ref(const u8 * const src, const u32 w, const u32 h,
+		const u32 rowsize, u32 *minx, u32 *maxx,
+		u32 *miny, u32 *maxy);
+
+// Runs every variant this CPU supports against it, false on a mismatch
+bool checkmargins();
+
+#endif
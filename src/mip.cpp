@@ -0,0 +1,170 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "mip.h"
+#include "helpers.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIP_X86 1
+#include <immintrin.h>
+#endif
+
+// Row kernels: n output pixels from two input rows. Every channel is
+// the rounded mean of its four inputs.
+
+typedef void (*halverow)(const u8 * const a, const u8 * const b,
+				const u32 n, u8 * const out);
+
+static void halve_c(const u8 * const a, const u8 * const b, const u32 n,
+			u8 * const out) {
+	u32 i, c;
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < 4; c++) {
+			out[i * 4 + c] = (a[i * 8 + c] + a[i * 8 + 4 + c] +
+					b[i * 8 + c] + b[i * 8 + 4 + c] + 2) >> 2;
+		}
+	}
+}
+
+#ifdef MIP_X86
+
+// Four output pixels at a time. The rows are summed in 16 bits, then
+// each pixel pair is folded onto its first half.
+__attribute__ ((target("sse2")))
+static void halve_sse2(const u8 * const a, const u8 * const b, const u32 n,
+			u8 * const out) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	u32 i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		const __m128i a0 = _mm_loadu_si128((const __m128i *) (a + i * 8));
+		const __m128i a1 = _mm_loadu_si128((const __m128i *) (a + i * 8 + 16));
+		const __m128i b0 = _mm_loadu_si128((const __m128i *) (b + i * 8));
+		const __m128i b1 = _mm_loadu_si128((const __m128i *) (b + i * 8 + 16));
+
+		__m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+					_mm_unpacklo_epi8(b0, zero));
+		__m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+					_mm_unpackhi_epi8(b0, zero));
+		__m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+					_mm_unpacklo_epi8(b1, zero));
+		__m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+					_mm_unpackhi_epi8(b1, zero));
+
+		s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+		s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+		s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+		s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+
+		__m128i q0 = _mm_unpacklo_epi64(s0, s1);
+		__m128i q1 = _mm_unpacklo_epi64(s2, s3);
+		q0 = _mm_srli_epi16(_mm_add_epi16(q0, two), 2);
+		q1 = _mm_srli_epi16(_mm_add_epi16(q1, two), 2);
+
+		_mm_storeu_si128((__m128i *) (out + i * 4),
+					_mm_packus_epi16(q0, q1));
+	}
+
+	halve_c(a + i * 8, b + i * 8, n - i, out + i * 4);
+}
+
+#endif // MIP_X86
+
+static halverow pickrow() {
+#ifdef MIP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		return halve_sse2;
+#endif
+	return halve_c;
+}
+
+static void rows(const halverow row, const u8 * const src,
+			const u32 rowsize, const u32 w, const u32 h,
+			u8 * const dst) {
+	u32 j;
+	for (j = 0; j < h; j++) {
+		const u8 * const a = src + j * 2 * rowsize;
+		row(a, a + rowsize, w, dst + j * w * 4);
+	}
+}
+
+void halve(const u8 * const src, const u32 rowsize, const u32 w,
+		const u32 h, u8 * const dst) {
+
+	static const halverow row = pickrow();
+	rows(row, src, rowsize, w, h, dst);
+}
+
+void halve_ref(const u8 * const src, const u32 rowsize, const u32 w,
+		const u32 h, u8 * const dst) {
+	u32 i, j, c;
+	for (j = 0; j < h; j++) {
+		for (i = 0; i < w; i++) {
+			for (c = 0; c < 4; c++) {
+				const u8 * const p = src + j * 2 * rowsize + i * 8 + c;
+				dst[(j * w + i) * 4 + c] = (p[0] + p[4] +
+						p[rowsize] + p[rowsize + 4] + 2) / 4;
+			}
+		}
+	}
+}
+
+bool checkhalve() {
+
+	// Every variant this CPU can run, on random sizes, strides and
+	// pixels, odd input sizes included
+	halverow variants[2] = { halve_c };
+	u32 num = 1, i, k;
+#ifdef MIP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		variants[num++] = halve_sse2;
+#endif
+
+	unsigned seed = 1;
+	bool ok = true;
+	for (i = 0; i < 300 && ok; i++) {
+		const u32 sw = 2 + rand_r(&seed) % 150;
+		const u32 sh = 2 + rand_r(&seed) % 40;
+		const u32 rowsize = (sw + rand_r(&seed) % 4) * 4;
+		const u32 w = sw / 2, h = sh / 2;
+
+		u8 * const src = (u8 *) xmalloc(rowsize * sh);
+		u8 * const ref = (u8 *) xmalloc(w * h * 4);
+		u8 * const got = (u8 *) xmalloc(w * h * 4);
+		for (k = 0; k < rowsize * sh; k++)
+			src[k] = rand_r(&seed);
+
+		halve_ref(src, rowsize, w, h, ref);
+		for (k = 0; k < num; k++) {
+			rows(variants[k], src, rowsize, w, h, got);
+			if (memcmp(got, ref, w * h * 4)) {
+				printf("halve variant %u: %ux%u stride %u differs\n",
+					k, sw, sh, rowsize);
+				ok = false;
+			}
+		}
+
+		free(src);
+		free(ref);
+		free(got);
+	}
+
+	return ok;
+}
@@ -0,0 +1,35 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MIP_H
+#define MIP_H
+
+#include "lrtypes.h"
+
+// Halve an XBGR8 bitmap with a 2x2 box filter. w and h are the output
+// size; an odd last row or column of the input is left out.
+void halve(const u8 * const src, const u32 rowsize, const u32 w,
+		const u32 h, u8 * const dst);
+
+// The plain loop, kept to check the others against
+void halve_ref(const u8 * const src, const u32 rowsize, const u32 w,
+		const u32 h, u8 * const dst);
+
+// Runs every variant this CPU supports against it, false on a mismatch
+bool checkhalve();
+
+#endif
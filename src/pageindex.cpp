@@ -0,0 +1,99 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "pageindex.h"
+#include "helpers.h"
+
+void indexinit(pageindex * const x, const u32 n) {
+	indexfree(x);
+
+	x->n = n;
+	x->sum = (double *) xcalloc(n + 1, sizeof(double));
+	x->count = (u32 *) xcalloc(n + 1, sizeof(u32));
+	x->height = (float *) xcalloc(n, sizeof(float));
+}
+
+void indexfree(pageindex * const x) {
+	free(x->sum);
+	free(x->count);
+	free(x->height);
+
+	x->sum = NULL;
+	x->count = NULL;
+	x->height = NULL;
+	x->n = 0;
+}
+
+void indexset(pageindex * const x, const u32 page, const float height) {
+
+	if (page >= x->n || height == x->height[page])
+		return;
+
+	const double diff = height - x->height[page];
+	const s32 known = (height > 0) - (x->height[page] > 0);
+	x->height[page] = height;
+
+	u32 i;
+	for (i = page + 1; i <= x->n; i += i & -i) {
+		x->sum[i] += diff;
+		x->count[i] += known;
+	}
+}
+
+double indexbefore(const pageindex * const x, const u32 page,
+			const float guess, const double scale, const double gap) {
+
+	double sum = 0;
+	u32 known = 0, i;
+	for (i = page < x->n ? page : x->n; i; i -= i & -i) {
+		sum += x->sum[i];
+		known += x->count[i];
+	}
+
+	return (sum + (page - known) * (double) guess) * scale + page * gap;
+}
+
+u32 indexfind(const pageindex * const x, const double y,
+		const float guess, const double scale, const double gap) {
+
+	if (!x->n)
+		return 0;
+
+	// Walk down the tree: a node at pos + step covers exactly the step
+	// pages after pos, so the guesses and gaps can be added per node.
+	u32 step = 1, pos = 0;
+	while (step * 2 <= x->n)
+		step *= 2;
+
+	double at = 0;
+	for (; step; step /= 2) {
+		const u32 next = pos + step;
+		if (next > x->n)
+			continue;
+
+		const double span = (x->sum[next] +
+				(step - x->count[next]) * (double) guess) * scale +
+				step * gap;
+		if (at + span <= y) {
+			pos = next;
+			at += span;
+		}
+	}
+
+	// That many pages end before y
+	return pos < x->n ? pos : x->n - 1;
+}
@@ -0,0 +1,50 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PAGEINDEX_H
+#define PAGEINDEX_H
+
+#include "lrtypes.h"
+
+// Running sums of the page heights, so both the offset of a page and the
+// page at an offset take O(log n). Pages of unknown height count as a
+// guess given at lookup, and every page gets a fixed gap after it.
+struct pageindex {
+	u32 n;
+
+	// Fenwick trees of the known heights, and of how many are known
+	double *sum;
+	u32 *count;
+
+	// 0 for unknown
+	float *height;
+};
+
+void indexinit(pageindex * const x, const u32 n);
+void indexfree(pageindex * const x);
+
+void indexset(pageindex * const x, const u32 page, const float height);
+
+// Where the page starts
+double indexbefore(const pageindex * const x, const u32 page,
+			const float guess, const double scale, const double gap);
+
+// Which page y is on
+u32 indexfind(const pageindex * const x, const double y,
+		const float guess, const double scale, const double gap);
+
+#endif
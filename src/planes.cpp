@@ -0,0 +1,139 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "planes.h"
+#include "codec.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <string.h>
+
+u32 planesize(const u8 format, const u32 w, const u32 h) {
+	switch (format) {
+		case PF_GRAY:
+			return w * h;
+		case PF_MONO:
+			return (w + 7) / 8 * h;
+	}
+	return w * h * 4;
+}
+
+u8 detect(const u8 * const src, const u32 rowsize, const u32 w,
+		const u32 h) {
+
+	// Gray if every pixel has equal channels, mono if they're also
+	// all black or white. The X byte is ignored.
+	bool mono = true;
+	u32 i, j;
+	for (j = 0; j < h; j++) {
+		const u32 * const row = (const u32 *) (src + j * rowsize);
+		for (i = 0; i < w; i++) {
+			const u32 v = row[i] & 0xffffff;
+			if ((v ^ (v >> 8)) & 0xffff)
+				return PF_XBGR;
+			if (v && v != 0xffffff)
+				mono = false;
+		}
+	}
+
+	return mono ? PF_MONO : PF_GRAY;
+}
+
+void pack(const u8 format, const u8 * const src, const u32 rowsize,
+		const u32 w, const u32 h, u8 * const dst) {
+
+	u32 i, j;
+
+	switch (format) {
+		case PF_XBGR:
+			for (j = 0; j < h; j++)
+				memcpy(dst + j * w * 4, src + j * rowsize, w * 4);
+		break;
+		case PF_GRAY:
+			for (j = 0; j < h; j++) {
+				const u8 * const row = src + j * rowsize;
+				u8 * const out = dst + j * w;
+				for (i = 0; i < w; i++)
+					out[i] = row[i * 4];
+			}
+		break;
+		case PF_MONO: {
+			const u32 stride = (w + 7) / 8;
+			memset(dst, 0, stride * h);
+			for (j = 0; j < h; j++) {
+				const u8 * const row = src + j * rowsize;
+				u8 * const out = dst + j * stride;
+				for (i = 0; i < w; i++) {
+					if (!row[i * 4])
+						out[i / 8] |= 0x80 >> (i % 8);
+				}
+			}
+		}
+		break;
+	}
+}
+
+void expand(const u8 format, const u8 * const src, const u32 w,
+		const u32 h, u8 * const dst) {
+
+	u32 * const out = (u32 *) dst;
+	u32 i, j;
+
+	switch (format) {
+		case PF_XBGR:
+			memcpy(dst, src, w * h * 4);
+		break;
+		case PF_GRAY:
+			for (i = 0; i < w * h; i++)
+				out[i] = 0xff000000 | src[i] * 0x010101;
+		break;
+		case PF_MONO: {
+			const u32 stride = (w + 7) / 8;
+			for (j = 0; j < h; j++) {
+				const u8 * const row = src + j * stride;
+				u32 * const line = out + j * w;
+				for (i = 0; i < w; i++) {
+					const bool black = row[i / 8] & (0x80 >> (i % 8));
+					line[i] = black ? 0xff000000 : 0xffffffff;
+				}
+			}
+		}
+		break;
+	}
+}
+
+bool unpack(const u8 codec, const u8 format, const u8 * const src,
+		const u32 size, const u32 w, const u32 h, u8 * const dst) {
+
+	if (format == PF_XBGR)
+		return decode(codec, src, size, dst, w * h * 4);
+
+	static __thread u8 *scratch;
+	static __thread u32 scratchsize;
+
+	const u32 len = planesize(format, w, h);
+	if (len > scratchsize) {
+		scratchsize = len;
+		scratch = (u8 *) realloc(scratch, len);
+		if (!scratch)
+			die("Out of memory\n");
+	}
+
+	if (!decode(codec, src, size, scratch, len))
+		return false;
+	expand(format, scratch, w, h, dst);
+	return true;
+}
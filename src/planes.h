@@ -0,0 +1,51 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PLANES_H
+#define PLANES_H
+
+#include "lrtypes.h"
+
+// How a block's pixels are laid out before compression
+enum pixformat {
+	PF_XBGR = 0,
+	PF_GRAY,	// one byte per pixel
+	PF_MONO,	// one bit per pixel, set for black, rows padded to bytes
+	PF_COUNT
+};
+
+u32 planesize(const u8 format, const u32 w, const u32 h);
+
+// The smallest format that holds w x h XBGR8 pixels of a strided
+// bitmap exactly
+u8 detect(const u8 * const src, const u32 rowsize, const u32 w,
+		const u32 h);
+
+// Copy them out into dst in that format
+void pack(const u8 format, const u8 * const src, const u32 rowsize,
+		const u32 w, const u32 h, u8 * const dst);
+
+// Back to packed XBGR8
+void expand(const u8 format, const u8 * const src, const u32 w,
+		const u32 h, u8 * const dst);
+
+// Decompress a stored block into XBGR8. The other formats go through
+// a buffer each thread keeps.
+bool unpack(const u8 codec, const u8 format, const u8 * const src,
+		const u32 size, const u32 w, const u32 h, u8 * const dst);
+
+#endif
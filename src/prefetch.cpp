@@ -0,0 +1,229 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "main.h"
+#include "diskcache.h"
+#include "planes.h"
+#include "prefetch.h"
+
+// The view decodes on a miss, right when a page scrolls in. This
+// thread does it for the next pages while the user is still scrolling
+// toward them, into a buffer the main thread uploads from. Only the
+// main thread talks to X, so it also grows the buffer between batches.
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t tid;
+static bool started, busy, done, quit;
+static u32 gen;
+
+static struct fetchreq want[PREFETCH_MAX], last[PREFETCH_MAX];
+static u32 numwant, numlast;
+static s8 wantdir, lastdir;
+
+static struct upbuf buf;
+static struct fetched staged[PREFETCH_MAX];
+static u32 numstaged, need;
+
+static u32 fetch(const struct fetchreq * const req, const s8 dir, u32 k,
+			u32 * const count, u32 * const used) {
+
+	// Decode as many of this page's blocks as there's room for. Past
+	// that, only count what the rest would need. The level is pinned
+	// and the lock let go for the decoding, the renderers and the view
+	// need it meanwhile.
+	const struct pagelevel * const l = &file->cache[req->page].level[req->lvl];
+	struct pageblock blocks[PREFETCH_MAX];
+	u32 i, n = 0;
+
+	pthread_mutex_lock(&file->lock);
+	if (!l->ready || l->dpi != req->dpi) {
+		pthread_mutex_unlock(&file->lock);
+		return k;
+	}
+
+	for (i = 0; i < l->numblocks && *count < PREFETCH_MAX; i++) {
+		const u32 blk = dir > 0 ? i : l->numblocks - 1 - i;
+		const struct pageblock * const b = &l->blocks[blk];
+
+		const u32 bytes = b->w * b->h * 4;
+		if (*used + bytes > PREFETCH_BYTES)
+			break;
+		const u32 offset = *used;
+		*used += bytes;
+		(*count)++;
+		if (*used > buf.size)
+			continue;
+
+		struct fetched * const f = &staged[k + n];
+		f->offset = offset;
+		f->page = req->page;
+		f->blk = blk;
+		f->w = b->w;
+		f->h = b->h;
+		f->dpi = req->dpi;
+		f->lvl = req->lvl;
+		blocks[n++] = *b;
+	}
+
+	if (n)
+		pinblocks();
+	pthread_mutex_unlock(&file->lock);
+
+	bool bad = false;
+	for (i = 0; i < n && !bad; i++) {
+		const struct pageblock * const b = &blocks[i];
+		bad = !unpack(b->codec, b->format, b->data, b->size, b->w, b->h,
+				buf.data + staged[k + i].offset);
+	}
+
+	if (n)
+		unpinblocks();
+
+	// A damaged cache file gets the page rendered again, anything
+	// else is a bug
+	if (bad) {
+		if (!diskbacked(blocks[0].data))
+			die(_("Error decompressing\n"));
+		dropdamaged(req->page, req->lvl, req->dpi);
+		return k;
+	}
+
+	return k + n;
+}
+
+static void *prefetcher(void *) {
+
+	struct fetchreq reqs[PREFETCH_MAX];
+	u32 i, n, k, count, used;
+	s8 dir;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		// The last batch has to be taken before a new one starts
+		while ((!numwant || done) && !quit)
+			pthread_cond_wait(&cond, &lock);
+		if (quit)
+			break;
+
+		n = numwant;
+		dir = wantdir;
+		memcpy(reqs, want, n * sizeof(struct fetchreq));
+		memcpy(last, want, n * sizeof(struct fetchreq));
+		numlast = n;
+		lastdir = dir;
+		numwant = 0;
+		busy = true;
+		const u32 mygen = gen;
+		pthread_mutex_unlock(&lock);
+
+		k = count = used = 0;
+		for (i = 0; i < n && count < PREFETCH_MAX; i++)
+			k = fetch(&reqs[i], dir, k, &count, &used);
+
+		pthread_mutex_lock(&lock);
+		busy = false;
+		if ((k || used > buf.size) && mygen == gen) {
+			numstaged = k;
+			need = used;
+			done = true;
+
+			const u8 msg = MSG_PREFETCH;
+			swrite(writepipe, &msg, 1);
+		}
+		pthread_cond_broadcast(&cond);
+	}
+
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void prefetch(const struct fetchreq * const reqs, const u32 n,
+		const s8 dir) {
+
+	pthread_mutex_lock(&lock);
+	if (!started) {
+		pthread_create(&tid, NULL, prefetcher, NULL);
+		started = true;
+	}
+
+	numwant = n < PREFETCH_MAX ? n : PREFETCH_MAX;
+	wantdir = dir;
+	memcpy(want, reqs, numwant * sizeof(struct fetchreq));
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+u32 prefetched(struct fetched ** const out, const struct upbuf ** const b) {
+
+	pthread_mutex_lock(&lock);
+	const u32 n = done ? numstaged : 0;
+	pthread_mutex_unlock(&lock);
+
+	*out = staged;
+	*b = &buf;
+	return n;
+}
+
+void prefetchdone() {
+	pthread_mutex_lock(&lock);
+
+	// The server has to be done reading before the next batch
+	upsync();
+
+	// What didn't fit gets another go with room for it
+	if (done && need > buf.size) {
+		upgrow(&buf, need);
+		if (!numwant) {
+			memcpy(want, last, numlast * sizeof(struct fetchreq));
+			numwant = numlast;
+			wantdir = lastdir;
+		}
+	}
+
+	done = false;
+	numstaged = need = 0;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void prefetchstop() {
+
+	// A batch in flight may be reading the old file's blocks
+	pthread_mutex_lock(&lock);
+	gen++;
+	numwant = 0;
+	done = false;
+	numstaged = need = 0;
+	while (busy)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void prefetchquit() {
+
+	// At exit. A batch in flight is finished, not cut off.
+	pthread_mutex_lock(&lock);
+	const bool running = started;
+	quit = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	if (running)
+		pthread_join(tid, NULL);
+	upfree(&buf);
+}
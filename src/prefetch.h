@@ -0,0 +1,61 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "lrtypes.h"
+#include "upbuf.h"
+
+// Blocks decoded ahead of the view at a time, and the most room
+// they may take
+#define PREFETCH_MAX 8
+#define PREFETCH_BYTES (32 * 1024 * 1024)
+
+// A page the view is about to reach, at the level it would show
+struct fetchreq {
+	u32 page;
+	u16 dpi;
+	u8 lvl;
+};
+
+// A block decoded to XBGR8 at offset in the upload buffer
+struct fetched {
+	u32 page, blk;
+	u32 w, h;
+	u32 offset;
+	u16 dpi;
+	u8 lvl;
+};
+
+// Replaces whatever was asked before. Pages go nearest first, their
+// blocks from the top when dir is positive, else from the bottom.
+void prefetch(const struct fetchreq * const reqs, const u32 n,
+		const s8 dir);
+
+// On MSG_PREFETCH, the main thread takes the batch and hands it back
+// once uploaded. That also grows the buffer if the batch didn't fit.
+u32 prefetched(struct fetched ** const out, const struct upbuf ** const buf);
+void prefetchdone();
+
+// Drop everything and wait for the thread, before freeing the file
+void prefetchstop();
+
+// Ends the thread, before the display is closed
+void prefetchquit();
+
+#endif
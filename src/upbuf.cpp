@@ -0,0 +1,158 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "main.h"
+#include "upbuf.h"
+
+#ifdef USE_XSHM
+
+// Whether the server can attach our segments, found out on first use.
+// A remote display has the extension but can't see our memory.
+static u8 shmok = UCHAR_MAX;
+static bool pending;
+static bool attachfailed;
+
+static int attacherror(Display *, XErrorEvent *) {
+	attachfailed = true;
+	return 0;
+}
+
+static bool attach(XShmSegmentInfo * const shm, const u32 len) {
+
+	shm->shmid = shmget(IPC_PRIVATE, len, IPC_CREAT | 0600);
+	if (shm->shmid < 0)
+		return false;
+
+	shm->shmaddr = (char *) shmat(shm->shmid, NULL, 0);
+	if (shm->shmaddr == (char *) -1) {
+		shmctl(shm->shmid, IPC_RMID, NULL);
+		return false;
+	}
+	shm->readOnly = True;
+
+	// Attach errors come back asynchronously
+	XSync(fl_display, False);
+	attachfailed = false;
+	int (*old)(Display *, XErrorEvent *) = XSetErrorHandler(attacherror);
+	XShmAttach(fl_display, shm);
+	XSync(fl_display, False);
+	XSetErrorHandler(old);
+
+	// Gone once both sides detach, even if we crash
+	shmctl(shm->shmid, IPC_RMID, NULL);
+
+	if (attachfailed) {
+		shmdt(shm->shmaddr);
+		return false;
+	}
+
+	return true;
+}
+
+static bool shmusable() {
+	if (shmok == UCHAR_MAX) {
+		int major, minor;
+		Bool pixmaps;
+		shmok = XShmQueryVersion(fl_display, &major, &minor, &pixmaps);
+	}
+	return shmok;
+}
+
+#endif
+
+void upgrow(struct upbuf * const b, const u32 len) {
+
+	if (len <= b->size)
+		return;
+
+	upfree(b);
+	b->size = len;
+
+#ifdef USE_XSHM
+	if (shmusable()) {
+		if (attach(&b->shm, len)) {
+			b->data = (u8 *) b->shm.shmaddr;
+			b->shared = true;
+			return;
+		}
+
+		// Don't try again if the server can't do it at all
+		if (attachfailed)
+			shmok = 0;
+	}
+#endif
+
+	b->data = (u8 *) xmalloc(len);
+}
+
+void upfree(struct upbuf * const b) {
+
+#ifdef USE_XSHM
+	if (b->shared) {
+		upsync();
+		XShmDetach(fl_display, &b->shm);
+		shmdt(b->shm.shmaddr);
+		b->shared = false;
+		b->data = NULL;
+	}
+#endif
+
+	free(b->data);
+	b->data = NULL;
+	b->size = 0;
+}
+
+void upput(const struct upbuf * const b, const u32 offset, const Drawable d,
+		const u32 w, const u32 h) {
+
+	XImage *xi;
+
+#ifdef USE_XSHM
+	if (b->shared) {
+		xi = XShmCreateImage(fl_display, fl_visual->visual, 24, ZPixmap,
+					(char *) b->data + offset,
+					(XShmSegmentInfo *) &b->shm, w, h);
+		if (xi == NULL) die("xi null\n");
+
+		XShmPutImage(fl_display, d, fl_gc, xi, 0, 0, 0, 0, w, h, False);
+		pending = true;
+
+		xi->data = NULL;
+		XDestroyImage(xi);
+		return;
+	}
+#endif
+
+	xi = XCreateImage(fl_display, fl_visual->visual, 24, ZPixmap, 0,
+				(char *) b->data + offset, w, h, 32, 0);
+	if (xi == NULL) die("xi null\n");
+
+	XPutImage(fl_display, d, fl_gc, xi, 0, 0, 0, 0, w, h);
+
+	xi->data = NULL;
+	XDestroyImage(xi);
+}
+
+void upsync() {
+#ifdef USE_XSHM
+	// One round trip covers every put before it
+	if (pending) {
+		XSync(fl_display, False);
+		pending = false;
+	}
+#endif
+}
@@ -0,0 +1,54 @@
+/*
+Copyright (C) 2015 Lauri Kasanen
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef UPBUF_H
+#define UPBUF_H
+
+#include <X11/Xlib.h>
+#include "autoconfig.h"
+#include "lrtypes.h"
+
+#if defined(HAVE_LIBXEXT) && defined(HAVE_X11_EXTENSIONS_XSHM_H)
+#define USE_XSHM 1
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
+
+// Pixels on their way to Pixmaps, decoded right here. With MIT-SHM the
+// server reads them straight from our memory, else they go through
+// the socket. One holds a batch of blocks back to back.
+struct upbuf {
+	u8 *data;
+	u32 size;
+	bool shared;
+#ifdef USE_XSHM
+	XShmSegmentInfo shm;
+#endif
+};
+
+// Room for at least len bytes. The contents don't survive.
+void upgrow(struct upbuf * const b, const u32 len);
+void upfree(struct upbuf * const b);
+
+// Copy w x h XBGR8 pixels at offset to d. Shared ones are read later,
+// so wait with upsync() before writing to any buffer again.
+void upput(const struct upbuf * const b, const u32 offset, const Drawable d,
+		const u32 w, const u32 h);
+void upsync();
+
+#endif
@@ -15,8 +15,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "view.h"
+#include "codec.h"
+#include "diskcache.h"
+#include "planes.h"
+#include "prefetch.h"
 #include <TextOutputDev.h>
 #include <glib/poppler-features.h>
+#include <omp.h>
 
 // Quarter inch in double resolution
 #define MARGIN 36
@@ -25,13 +30,31 @@ pdfview::pdfview(int x, int y, int w, int h): Fl_Widget(x, y, w, h),
 		yoff(0), xoff(0),
 		selx(0), sely(0), selx2(0), sely2(0) {
 
-	cachedsize = 7 * 1024 * 1024;
+	numslots = CACHE_MIN;
+	cachedbytes = 0;
+	lastzoom = 0;
+	settled = false;
+	tick = frametick = frameblocks = 0;
+	hits = misses = fetchedin = 0;
+	speed = 0;
+	lastscroll = 0;
+	showndpi = 0;
+	winpict = None;
+	winpictfor = None;
+
+	memset(&heights, 0, sizeof(pageindex));
+	heightmode = UCHAR_MAX;
+	heightgen = 0;
+
+	// The staging buffer grows as batches need it
+	memset(&staging, 0, sizeof(struct upbuf));
 
 	u32 i;
 	for (i = 0; i < CACHE_MAX; i++) {
-		cache[i] = (u8 *) xcalloc(cachedsize, 1);
 		cachedpage[i] = USHRT_MAX;
+		cachedtick[i] = 0;
 		pix[i] = None;
+		pict[i] = None;
 	}
 }
 
@@ -45,14 +68,57 @@ void pdfview::reset() {
 
 	resetselection();
 
+	lastzoom = 0;
+	settled = false;
+	speed = 0;
+	showndpi = 0;
+
+	// A new file, the page heights start over
+	heightmode = UCHAR_MAX;
+
+	stats();
+	hits = misses = fetchedin = 0;
+
 	u32 i;
 	for (i = 0; i < CACHE_MAX; i++) {
-		cachedpage[i] = USHRT_MAX;
+		drop(i);
 	}
 }
 
+void pdfview::stats() const {
+	if (!details || !(hits + misses))
+		return;
+
+	printf(_("View cache: %u hits, %u misses (%.1f%% hit), %u prefetched\n"),
+		hits, misses, 100 * hits / (float) (hits + misses), fetchedin);
+	printf(_("View cache at %u slots, Pixmaps take %.2fmb\n"),
+		numslots, cachedbytes / 1024 / 1024.0f);
+}
+
+void pdfview::settle(void *data) {
+	pdfview * const v = (pdfview *) data;
+	v->settled = true;
+	v->redraw();
+}
+
+static XRenderPictFormat *rgb24() {
+	static XRenderPictFormat *fmt = NULL;
+	if (!fmt)
+		fmt = XRenderFindStandardFormat(fl_display, PictStandardRGB24);
+	return fmt;
+}
+
+static bool sized(const u32 page) {
+	// Rendered, or at least its size known from the page tree
+	return file->cache[page].ready || file->cache[page].pageh;
+}
+
 static u32 fullh(u32 page) {
-	if (!file->cache[page].ready)
+	// Without margins yet, the whole page from the page tree
+	const cachedpage * const cur = &file->cache[page];
+	if (!cur->ready && cur->bbox != BB_OK && cur->pageh)
+		return cur->pageh;
+	if (!sized(page))
 		page = 0;
 
 	if (file->mode == Z_TRIM)
@@ -64,7 +130,10 @@ static u32 fullh(u32 page) {
 }
 
 static u32 fullw(u32 page) {
-	if (!file->cache[page].ready)
+	const cachedpage * const cur = &file->cache[page];
+	if (!cur->ready && cur->bbox != BB_OK && cur->pagew)
+		return cur->pagew;
+	if (!sized(page))
 		page = 0;
 
 	if (file->mode == Z_TRIM)
@@ -88,27 +157,103 @@ static bool hasmargins(const u32 page) {
 		file->cache[page].bottom > MARGIN;
 }
 
-static void updatevisible(const float yoff, const u32 w, const u32 h, const bool fromdraw) {
+static bool fitwidth() {
+	return file->mode != Z_CUSTOM && file->mode != Z_PAGE;
+}
+
+static float unith(const u32 page) {
+
+	// A page's height in what the zoom mode scales: relative to its
+	// width when fitting that, as is otherwise
+	const u32 fw = fullw(page);
+	if (!fitwidth())
+		return fullh(page);
+	return fw ? fullh(page) / (float) fw : 0;
+}
+
+static double unitscale(const u32 w) {
+	return fitwidth() ? w : file->zoom;
+}
+
+static u32 rowh(const u32 page, const u32 w) {
+	return unith(page) * unitscale(w) + MARGIN * file->zoom;
+}
+
+void pdfview::syncheights() {
+
+	// Catch up with the pages the renderer finished. The units change
+	// with the mode, then everything is redone.
+	const u32 gen = __sync_fetch_and_add(&file->geomgen, 0);
+	u32 i, j;
+
+	if (heightmode != file->mode || heights.n != file->pages) {
+		indexinit(&heights, file->pages);
+		for (i = 0; i < (file->pages + 63) / 64; i++)
+			__sync_fetch_and_and(&file->dirty[i], 0);
+		for (i = 0; i < file->pages; i++) {
+			if (sized(i))
+				indexset(&heights, i, unith(i));
+		}
+		heightmode = file->mode;
+		heightgen = gen;
+		return;
+	}
+
+	if (gen == heightgen)
+		return;
+	heightgen = gen;
+
+	for (i = 0; i < (file->pages + 63) / 64; i++) {
+		const u64 bits = __sync_fetch_and_and(&file->dirty[i], 0);
+		for (j = 0; j < 64; j++) {
+			if (bits & (1ULL << j))
+				indexset(&heights, i * 64 + j, unith(i * 64 + j));
+		}
+	}
+}
+
+double pdfview::pagetop(const u32 page, const u32 w) const {
+	// Pages not in yet are guessed at the size of the first
+	return indexbefore(&heights, page, sized(0) ? unith(0) : 0,
+				unitscale(w), MARGIN * file->zoom);
+}
+
+u32 pdfview::pageat(const double y, const u32 w) const {
+	return indexfind(&heights, y, sized(0) ? unith(0) : 0,
+				unitscale(w), MARGIN * file->zoom);
+}
+
+double pdfview::yoffpx(const float at, const u32 w) const {
+	u32 page = at < 0 ? 0 : at;
+	if (page > file->pages - 1)
+		page = file->pages - 1;
+	return pagetop(page, w) + (at - page) * rowh(page, w);
+}
+
+float pdfview::pxyoff(const double y, const u32 w) const {
+	if (y <= 0)
+		return 0;
+
+	const u32 page = pageat(y, w);
+	return page + (y - pagetop(page, w)) / rowh(page, w);
+}
+
+void pdfview::updatevisible(const float at, const u32 w, const u32 h, const bool fromdraw) {
 	// From the current zoom mode and view offset, update the visible page info
 	const u32 prev = file->first_visible;
-	file->first_visible = yoff < 0 ? 0 : yoff;
+	file->first_visible = at < 0 ? 0 : at;
 	if (file->first_visible > file->pages - 1)
 		file->first_visible = file->pages - 1;
 	u32 i;
 
 	const u32 maxw = file->maxw ? file->maxw : file->cache[0].w;
-	const u32 maxh = file->maxh ? file->maxh : file->cache[0].h;
 	const u32 maxwmargin = hasmargins(file->first_visible) ? maxw + MARGIN * 2 : maxw;
 	const u32 fullw = ::fullw(0);
 	const u32 fullh = ::fullh(0);
 
-	const float visible = yoff < 0 ? 0 : 1 - (yoff - floorf(yoff));
-
-	u32 usedh = fullh;
 	switch (file->mode) {
 		case Z_TRIM:
 			file->zoom = w / (float) maxwmargin;
-			usedh = maxh;
 		break;
 		case Z_WIDTH:
 			file->zoom = w / (float) fullw;
@@ -124,15 +269,10 @@ static void updatevisible(const float yoff, const u32 w, const u32 h, const bool
 		break;
 	}
 
-	const u32 zoomedmargin = MARGIN * file->zoom;
-	i = file->first_visible;
-	u32 tmp = visible * usedh * file->zoom;
-	tmp += zoomedmargin;
-	while (tmp < h) {
-		tmp += usedh * file->zoom;
-		tmp += zoomedmargin;
-		i++;
-	}
+	// The page at the bottom edge, from the real page heights
+	syncheights();
+	i = pageat(yoffpx(at, w) + h, w);
+
 	// Be conservative
 	if (i < file->pages - 1)
 		i++;
@@ -141,6 +281,8 @@ static void updatevisible(const float yoff, const u32 w, const u32 h, const bool
 	file->last_visible = i;
 
 	if (prev != file->first_visible) {
+		viewmoved(prev);
+
 		char buf[10];
 		snprintf(buf, 10, "%u", file->first_visible + 1);
 		pagebox->value(buf);
@@ -150,13 +292,35 @@ static void updatevisible(const float yoff, const u32 w, const u32 h, const bool
 	}
 }
 
+void pdfview::relayout() {
+
+	// The widest or tallest page changed, so did the trim zoom and
+	// what fits on screen
+	if (!file->cache)
+		return;
+
+	updatevisible(yoff, w(), h(), false);
+	redraw();
+}
+
 void pdfview::draw() {
 
 	if (!file->cache)
 		return;
 
+	frametick = tick + 1;
+	frameblocks = 0;
 	updatevisible(yoff, w(), h(), true);
 
+	// Once the zoom stops changing, the visible pages get rendered
+	// at the size they're shown at.
+	if (file->zoom != lastzoom) {
+		lastzoom = file->zoom;
+		settled = false;
+		Fl::remove_timeout(settle, this);
+		Fl::add_timeout(0.3, settle, this);
+	}
+
 	const Fl_Color pagecol = FL_WHITE;
 	int X, Y, W, H;
 	fl_clip_box(x(), y(), w(), h(), X, Y, W, H);
@@ -166,7 +330,7 @@ void pdfview::draw() {
 	fl_rectf(X, Y, W, H, FL_GRAY + 1);
 
 	struct cachedpage *cur = &file->cache[file->first_visible];
-	if (!cur->ready)
+	if (!sized(file->first_visible))
 		return;
 
 	fl_push_clip(X, Y, W, H);
@@ -187,8 +351,9 @@ void pdfview::draw() {
 	Y = y() - visible * H;
 
 	for (i = file->first_visible; i <= max; i++) {
+		// Pages not rendered yet get their blank rect
 		cur = &file->cache[i];
-		if (!cur->ready)
+		if (!sized(i))
 			break;
 
 		H = (fullh(i) + MARGIN) * file->zoom;
@@ -249,20 +414,19 @@ void pdfview::draw() {
 	}
 
 	fl_pop_clip();
+
+	fitcache();
+	ahead();
 }
 
 u32 pdfview::pxrel(u32 page) const {
-	if (file->mode != Z_CUSTOM && file->mode != Z_PAGE) {
-		const float ratio = w() / (float) fullw(page);
-		return fullh(page) * ratio + MARGIN * file->zoom;
-	}
-	return (fullh(page) + MARGIN) * file->zoom;
+	return rowh(page, w());
 }
 
 float pdfview::maxyoff() const {
 
 	const u32 last = file->pages - 1;
-	if (!file->cache[last].ready)
+	if (!sized(last))
 		return last + 0.5f;
 
 	s32 sh = pxrel(last);
@@ -290,6 +454,7 @@ int pdfview::handle(int e) {
 		return Fl_Widget::handle(e);
 
 	const float move = 0.05f;
+	const float prev = yoff;
 	static int lasty, lastx;
 
 	switch (e) {
@@ -302,20 +467,15 @@ int pdfview::handle(int e) {
 				const u32 zoomedmargin = MARGIN * file->zoom;
 				const u32 zoomedmarginhalf = zoomedmargin / 2;
 
-				// Which page is selx,sely on?
-				u32 page = yoff;
-				const float floored = yoff - floorf(yoff);
-				const float visible = 1 - floored;
-				u32 zoomedh = fullh(page) * visible * file->zoom;
+				// Which page is selx,sely on, and how much of it
+				// is above the widget
+				syncheights();
+				const double top = yoffpx(yoff, w());
+				const u32 page = pageat(top + sely - y(), w());
+				const double above = top - pagetop(page, w());
 				const u32 ratiominus = hasmargins(page) ? zoomedmargin : 0;
 				const float ratio = w() / (float) fullw(page);
 				const float ratiox = (w() - ratiominus) / (float) fullw(page);
-				if (file->mode != Z_CUSTOM && file->mode != Z_PAGE) {
-					zoomedh = fullh(page) * visible * ratio;
-				}
-
-				if (y() + zoomedh < sely)
-					page++;
 
 				// We assume nobody selects text with a tiny zoom.
 				u32 X, Y, W, H;
@@ -343,8 +503,7 @@ int pdfview::handle(int e) {
 				switch (file->mode) {
 					case Z_TRIM:
 						// X and Y start in widget space, 0 to w/h.
-						Y += floored * (fullh(page) * ratiox +
-								zoomedmargin + ratiominus);
+						Y += above;
 						Y -= zoomedmarginhalf; // Grey margin
 
 						if (hasmargins(page)) {
@@ -364,8 +523,7 @@ int pdfview::handle(int e) {
 					break;
 					case Z_WIDTH:
 						// X and Y start in widget space, 0 to w/h.
-						Y += floored * (fullh(page) * ratio +
-								zoomedmargin);
+						Y += above;
 						Y -= zoomedmarginhalf; // Grey margin
 
 						X /= ratio;
@@ -376,8 +534,7 @@ int pdfview::handle(int e) {
 					case Z_PAGE:
 					case Z_CUSTOM:
 						// X and Y start in widget space, 0 to w/h.
-						Y += floored * (fullh(page) * file->zoom +
-								zoomedmargin);
+						Y += above;
 						Y -= zoomedmarginhalf; // Grey margin
 
 						X -= (w() - (fullw(page) * file->zoom)) / 2 +
@@ -441,14 +598,9 @@ int pdfview::handle(int e) {
 
 			fl_cursor(FL_CURSOR_MOVE);
 
-			if (file->maxh) {
-				if (file->mode != Z_TRIM)
-					yoff -= (movedy / file->zoom) / fullh(0);
-				else
-					yoff -= (movedy / file->zoom) / file->maxh;
-			} else {
-				yoff -= (movedy / (float) h()) / file->zoom;
-			}
+			// Exactly the pixels dragged, whatever the page sizes
+			syncheights();
+			yoff = pxyoff(yoffpx(yoff, w()) - movedy, w());
 
 			xoff += (movedx / file->zoom) / fullw(0);
 
@@ -467,6 +619,7 @@ int pdfview::handle(int e) {
 			lasty = my;
 			lastx = mx;
 
+			scrolled(prev);
 			if (file->cache)
 				updatevisible(yoff, w(), h(), false);
 			redraw();
@@ -487,6 +640,7 @@ int pdfview::handle(int e) {
 			}
 
 			resetselection();
+			scrolled(prev);
 			if (file->cache)
 				updatevisible(yoff, w(), h(), false);
 			redraw();
@@ -624,7 +778,7 @@ int pdfview::handle(int e) {
 						u32 page = yoff;
 						s32 sh = pxrel(page);
 
-						if (file->cache[page].ready) {
+						if (sized(page)) {
 							const s32 hidden = sh - h();
 							float tmp = floorf(yoff) + hidden / (float) sh;
 							if (tmp > yoff)
@@ -646,6 +800,7 @@ int pdfview::handle(int e) {
 					return 0;
 			}
 
+			scrolled(prev);
 			if (file->cache)
 				updatevisible(yoff, w(), h(), false);
 
@@ -653,7 +808,7 @@ int pdfview::handle(int e) {
 		break;
 		case FL_MOVE:
 			// Set the cursor appropriately
-			if (!file->maxw)
+			if (file->loading)
 				fl_cursor(FL_CURSOR_WAIT);
 			else if (selecting->value())
 				fl_cursor(FL_CURSOR_INSERT);
@@ -665,68 +820,384 @@ int pdfview::handle(int e) {
 	return Fl_Widget::handle(e);
 }
 
-u8 pdfview::iscached(const u32 page) const {
+u8 pdfview::iscached(const u32 page, const u8 lvl, const u16 dpi,
+			const u32 blk) const {
 	u32 i;
 	for (i = 0; i < CACHE_MAX; i++) {
-		if (cachedpage[i] == page)
+		if (cachedpage[i] == page && cachedlevel[i] == lvl &&
+			cacheddpi[i] == dpi && cachedblock[i] == blk)
 			return i;
 	}
 
 	return UCHAR_MAX;
 }
 
-void pdfview::docache(const u32 page) {
+bool pdfview::docache(const u32 page, const u8 lvl, const u16 dpi,
+			const u32 * const blks, u8 * const slots, const u32 n) {
 
-	// Insert it to cache. Pick the slot at random.
-	const struct cachedpage * const cur = &file->cache[page];
+	// Insert these blocks to cache, at most numslots. Each takes the
+	// least recently used slot, so none of them overwrite each other.
+	const struct pagelevel * const cur = &file->cache[page].level[lvl];
 	u32 i;
 
-	if (cur->uncompressed > cachedsize) {
-		cachedsize = cur->uncompressed;
+	// A zoomed level may get replaced under us. The blocks are copied
+	// and pinned, and decoded without the lock.
+	pthread_mutex_lock(&file->lock);
+
+	// Be safe
+	bool ok = cur->ready && cur->dpi == dpi;
+	for (i = 0; i < n && ok; i++)
+		ok = blks[i] < cur->numblocks;
+	if (!ok) {
+		pthread_mutex_unlock(&file->lock);
+		return false;
+	}
+
+	// Back to back in the staging buffer
+	struct pageblock blocks[CACHE_MAX];
+	u32 offsets[CACHE_MAX];
+	u32 total = 0;
+	for (i = 0; i < n; i++) {
+		blocks[i] = cur->blocks[blks[i]];
+		offsets[i] = total;
+		total += blocks[i].w * blocks[i].h * 4;
+	}
+
+	pinblocks();
+	pthread_mutex_unlock(&file->lock);
+
+	// The server may still be reading the last batch from it
+	upsync();
+	upgrow(&staging, total);
 
-		for (i = 0; i < CACHE_MAX; i++) {
-			cache[i] = (u8 *) realloc(cache[i], cachedsize);
+	for (i = 0; i < n; i++) {
+		const u8 dst = takeslot();
+		slots[i] = dst;
+
+		cachedpage[dst] = page;
+		cachedlevel[dst] = lvl;
+		cacheddpi[dst] = dpi;
+		cachedblock[dst] = blks[i];
+		cachedw[dst] = blocks[i].w;
+		cachedh[dst] = blocks[i].h;
+	}
+
+	// A tall page at high zoom can have many strips to show at once.
+	// No more threads than strips, the renderers are busy too.
+	bool bad = false;
+	const int threads = n < (u32) omp_get_max_threads() ?
+				n : omp_get_max_threads();
+	#pragma omp parallel for if (n > 1) num_threads(threads) schedule(dynamic)
+	for (i = 0; i < n; i++) {
+		const struct pageblock * const b = &blocks[i];
+
+		if (!unpack(b->codec, b->format, b->data, b->size, b->w, b->h,
+				staging.data + offsets[i]))
+			bad = true;
+	}
+
+	unpinblocks();
+
+	// A damaged cache file gets its pages rendered again, anything
+	// else is a bug
+	if (bad) {
+		if (!diskbacked(blocks[0].data))
+			die(_("Error decompressing\n"));
+		for (i = 0; i < n; i++)
+			cachedpage[slots[i]] = USHRT_MAX;
+		dropdamaged(page, lvl, dpi);
+		return false;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!upload(slots[i], &staging, offsets[i]))
+			slots[i] = UCHAR_MAX;
+	}
+
+	trim();
+	return true;
+}
+
+u8 pdfview::takeslot() {
+
+	// An empty slot, else the least recently used. What's on screen
+	// was used last, so it goes last.
+	u32 i;
+	u8 s = 0;
+	for (i = 0; i < numslots; i++) {
+		if (cachedpage[i] == USHRT_MAX) {
+			s = i;
+			break;
 		}
+		if (cachedtick[i] < cachedtick[s])
+			s = i;
 	}
 
-	// Be safe
-	if (!cur->ready)
+	drop(s);
+	cachedtick[s] = ++tick;
+	return s;
+}
+
+void pdfview::drop(const u8 slot) {
+	if (pict[slot] != None) {
+		XRenderFreePicture(fl_display, pict[slot]);
+		pict[slot] = None;
+	}
+	if (pix[slot] != None) {
+		XFreePixmap(fl_display, pix[slot]);
+		pix[slot] = None;
+		cachedbytes -= cachedw[slot] * cachedh[slot] * 4;
+	}
+	cachedpage[slot] = USHRT_MAX;
+}
+
+void pdfview::trim() {
+
+	// Over the byte budget, the oldest go, but not what's on screen
+	while (cachedbytes > CACHE_BYTES) {
+		u8 s = UCHAR_MAX;
+		u32 i;
+		for (i = 0; i < numslots; i++) {
+			if (pix[i] == None || cachedtick[i] >= frametick)
+				continue;
+			if (s == UCHAR_MAX || cachedtick[i] < cachedtick[s])
+				s = i;
+		}
+		if (s == UCHAR_MAX)
+			break;
+		drop(s);
+	}
+}
+
+void pdfview::fitcache() {
+
+	// Room for the blocks on screen, and as many again for the two
+	// pages around them that scrolling reaches next
+	const u32 pages = file->last_visible - file->first_visible + 1;
+	u32 want = frameblocks + (frameblocks * 2 + pages - 1) / pages;
+	if (want < CACHE_MIN)
+		want = CACHE_MIN;
+	if (want > CACHE_MAX)
+		want = CACHE_MAX;
+
+	// Shrink only when it's a lot less, when zoomed in a good deal;
+	// the slots let go are at the old size anyway.
+	if (want >= numslots) {
+		numslots = want;
+		return;
+	}
+	if (want * 2 > numslots)
 		return;
 
-	const u32 dst = rand() % CACHE_MAX;
+	u32 i;
+	for (i = want; i < numslots; i++)
+		drop(i);
+	numslots = want;
 
-	lzo_uint dstsize = cachedsize;
-	const int ret = lzo1x_decompress(cur->data,
-					cur->size,
-					cache[dst],
-					&dstsize,
-					NULL);
-	if (ret != LZO_E_OK || dstsize != cur->uncompressed)
-		die(_("Error decompressing\n"));
+	// Batches will be smaller too
+	upfree(&staging);
+}
 
-	cachedpage[dst] = page;
+bool pdfview::upload(const u8 slot, const struct upbuf * const b,
+			const u32 offset) {
 
-	// Create the Pixmap
-	if (pix[dst] != None)
-		XFreePixmap(fl_display, pix[dst]);
+	const u32 w = cachedw[slot];
+	const u32 h = cachedh[slot];
 
-	pix[dst] = XCreatePixmap(fl_display, fl_window, cur->w, cur->h, 24);
-	if (pix[dst] == None)
-		return;
+	// Create the Pixmap. Outside draw() fl_window isn't set, so go
+	// by our own window. Taking the slot freed the old one.
+	pix[slot] = XCreatePixmap(fl_display, fl_xid(window()), w, h, 24);
+	if (pix[slot] == None) {
+		cachedpage[slot] = USHRT_MAX;
+		return false;
+	}
+	cachedbytes += w * h * 4;
 
 	fl_push_no_clip();
+	upput(b, offset, pix[slot], w, h);
+	fl_pop_clip();
 
-	XImage *xi = XCreateImage(fl_display, fl_visual->visual, 24, ZPixmap, 0,
-					(char *) cache[dst], cur->w, cur->h,
-					32, 0);
-	if (xi == NULL) die("xi null\n");
+	// Made once, drawn from every frame it's on screen. RepeatPad
+	// corresponds to GL_CLAMP_TO_EDGE.
+	XRenderPictureAttributes attr;
+	memset(&attr, 0, sizeof(XRenderPictureAttributes));
+	attr.repeat = RepeatPad;
 
-	XPutImage(fl_display, pix[dst], fl_gc, xi, 0, 0, 0, 0, cur->w, cur->h);
+	pict[slot] = XRenderCreatePicture(fl_display, pix[slot], rgb24(),
+						CPRepeat, &attr);
+	XRenderSetPictureFilter(fl_display, pict[slot], "bilinear", NULL, 0);
+	scalex[slot] = scaley[slot] = 0;
 
-	fl_pop_clip();
+	return true;
+}
+
+void pdfview::scale(const u8 slot, const XFixed sx, const XFixed sy) {
+
+	// Only sent when the zoom changed since the slot was last drawn
+	if (scalex[slot] == sx && scaley[slot] == sy)
+		return;
+
+	XTransform xf;
+	memset(&xf, 0, sizeof(XTransform));
+	xf.matrix[0][0] = sx;
+	xf.matrix[1][1] = sy;
+	xf.matrix[2][2] = 65536;
+	XRenderSetPictureTransform(fl_display, pict[slot], &xf);
+
+	scalex[slot] = sx;
+	scaley[slot] = sy;
+}
+
+Picture pdfview::target() {
+
+	// The window's Picture lasts as long as the buffer we draw to,
+	// a new one comes with resizing
+	if (fl_window != winpictfor) {
+		if (winpict != None)
+			XRenderFreePicture(fl_display, winpict);
+		winpict = XRenderCreatePicture(fl_display, fl_window, rgb24(),
+						0, NULL);
+		winpictfor = fl_window;
+		memset(&winclip, 0, sizeof(XRectangle));
+	}
+
+	int cx, cy, cw, ch;
+	fl_clip_box(x(), y(), w(), h(), cx, cy, cw, ch);
+	if (cx != winclip.x || cy != winclip.y || cw != winclip.width ||
+		ch != winclip.height) {
+		winclip.x = cx;
+		winclip.y = cy;
+		winclip.width = cw;
+		winclip.height = ch;
+		XRenderSetPictureClipRectangles(fl_display, winpict, 0, 0,
+						&winclip, 1);
+	}
+
+	return winpict;
+}
+
+void pdfview::scrolled(const float prev) {
+
+	// Pages per second, averaged over the last few events. After a
+	// pause it starts over.
+	const u64 now = msec();
+	const u64 ms = now - lastscroll;
+	lastscroll = now;
+
+	if (yoff == prev)
+		return;
+
+	const float v = (yoff - prev) * 1000 / (ms ? ms : 1);
+	speed = ms > 500 ? v : (speed + v) / 2;
+}
+
+static bool closedpi(const u32 have, const u32 want) {
+	return have * 10 >= want * 9 && have * 10 <= want * 11;
+}
+
+static u8 bestlevel(const cachedpage * const cur, const u32 dpi) {
+
+	// The smallest ready level that's sharp enough, else the sharpest
+	u8 best = UCHAR_MAX;
+	u32 l;
+	for (l = 0; l < L_COUNT; l++) {
+		if (!cur->level[l].ready)
+			continue;
+		if (best == UCHAR_MAX) {
+			best = l;
+			continue;
+		}
+
+		const u32 have = cur->level[best].dpi;
+		const u32 cand = cur->level[l].dpi;
+		const bool haveok = have * 10 >= dpi * 9;
+		const bool candok = cand * 10 >= dpi * 9;
+
+		if ((candok && (!haveok || cand < have)) ||
+			(!candok && !haveok && cand > have))
+			best = l;
+	}
 
-	xi->data = NULL;
-	XDestroyImage(xi);
+	return best;
+}
+
+void pdfview::ahead() {
+
+	// While scrolling, the next page or two in that direction get
+	// decoded on the prefetch thread before they come into view
+	if (!speed || !showndpi || msec() - lastscroll > 1000)
+		return;
+
+	const s8 dir = speed > 0 ? 1 : -1;
+	const u32 pages = fabsf(speed) > 1 ? 2 : 1;
+	struct fetchreq reqs[2];
+	u32 i, n = 0;
+
+	for (i = 0; i < pages; i++) {
+		const s64 page = dir > 0 ? (s64) file->last_visible + i :
+					(s64) file->first_visible - 1 - i;
+		if (page < 0 || page >= file->pages)
+			break;
+
+		const struct cachedpage * const pg = &file->cache[page];
+		const u8 lvl = bestlevel(pg, showndpi);
+		if (lvl == UCHAR_MAX)
+			continue;
+
+		pthread_mutex_lock(&file->lock);
+		const u16 dpi = pg->level[lvl].dpi;
+		const u32 num = pg->level[lvl].numblocks;
+		pthread_mutex_unlock(&file->lock);
+
+		// Already up from the edge it enters by
+		if (!num || iscached(page, lvl, dpi,
+				dir > 0 ? 0 : num - 1) != UCHAR_MAX)
+			continue;
+
+		reqs[n].page = page;
+		reqs[n].lvl = lvl;
+		reqs[n].dpi = dpi;
+		n++;
+	}
+
+	if (n)
+		prefetch(reqs, n, dir);
+}
+
+void pdfview::takeahead() {
+
+	// Upload what the prefetch thread decoded, unless it's here by now
+	struct fetched *f;
+	const struct upbuf *b;
+	u32 n = prefetched(&f, &b);
+	u32 i;
+
+	if (!file->cache || !window() || !window()->shown())
+		n = 0;
+
+	// Not called from draw(), so the window has to be made current
+	// for FLTK's clip and GC
+	if (n)
+		window()->make_current();
+
+	for (i = 0; i < n; i++) {
+		if (iscached(f[i].page, f[i].lvl, f[i].dpi, f[i].blk) !=
+				UCHAR_MAX)
+			continue;
+
+		const u8 slot = takeslot();
+		cachedpage[slot] = f[i].page;
+		cachedlevel[slot] = f[i].lvl;
+		cacheddpi[slot] = f[i].dpi;
+		cachedblock[slot] = f[i].blk;
+		cachedw[slot] = f[i].w;
+		cachedh[slot] = f[i].h;
+		if (upload(slot, b, f[i].offset))
+			fetchedin++;
+	}
+
+	trim();
+	prefetchdone();
 }
 
 void pdfview::go(const u32 page) {
@@ -735,41 +1206,123 @@ void pdfview::go(const u32 page) {
 	redraw();
 }
 
+static bool inclip(const struct pageblock * const b, const s32 X, const s32 Y,
+			const u32 W, const u32 H, const u32 lw, const u32 lh,
+			const int cx, const int cy, const int cw, const int ch,
+			s32 * const bx, s32 * const by,
+			s32 * const bx2, s32 * const by2) {
+
+	// Where this block lands
+	*bx = X + (s64) b->x * W / lw;
+	*by = Y + (s64) b->y * H / lh;
+	*bx2 = X + (s64) (b->x + b->w) * W / lw;
+	*by2 = Y + (s64) (b->y + b->h) * H / lh;
+
+	return !(*bx2 <= cx || *by2 <= cy || *bx >= cx + cw || *by >= cy + ch);
+}
+
+static void blit(const Picture src, const Picture dst,
+			const s32 bx, const s32 by, const s32 bx2, const s32 by2) {
+
+	// Do a gpu-accelerated bilinear blit
+	XRenderComposite(fl_display, PictOpSrc, src, None, dst, 0, 0, 0, 0,
+				bx, by, bx2 - bx, by2 - by);
+}
+
 void pdfview::content(const u32 page, const s32 X, const s32 Y,
 			const u32 W, const u32 H) {
 
-	// Do a gpu-accelerated bilinear blit
-	u8 c = iscached(page);
-	if (c == UCHAR_MAX)
-		docache(page);
-	c = iscached(page);
+	const struct cachedpage * const pg = &file->cache[page];
 
-	const struct cachedpage * const cur = &file->cache[page];
+	// Sized from the page tree only, nothing to show yet
+	if (!pg->ready || !pg->w)
+		return;
 
-	XRenderPictureAttributes srcattr;
-	memset(&srcattr, 0, sizeof(XRenderPictureAttributes));
-	XRenderPictFormat *fmt = XRenderFindStandardFormat(fl_display, PictStandardRGB24);
+	// The resolution this page is shown at
+	u32 dpi = FULL_DPI * W / pg->w;
+	if (dpi < PREVIEW_DPI)
+		dpi = PREVIEW_DPI;
+	if (dpi > MAX_ZOOM_DPI)
+		dpi = MAX_ZOOM_DPI;
 
-	// This corresponds to GL_CLAMP_TO_EDGE.
-	srcattr.repeat = RepeatPad;
+	const u8 lvl = bestlevel(pg, dpi);
+	if (lvl == UCHAR_MAX)
+		return;
+	showndpi = dpi;
 
-	Picture src = XRenderCreatePicture(fl_display, pix[c], fmt, CPRepeat, &srcattr);
-	Picture dst = XRenderCreatePicture(fl_display, fl_window, fmt, 0, &srcattr);
+	// Once the zoom has settled, have it rendered at exactly this size,
+	// unless what we have is close enough.
+	if (settled)
+		requestdpi(page, closedpi(pg->level[lvl].dpi, dpi) ? 0 : dpi);
 
-	const Fl_Region clipr = fl_clip_region();
-	XRenderSetPictureClipRegion(fl_display, dst, clipr);
+	int cx, cy, cw, ch;
+	fl_clip_box(X, Y, W, H, cx, cy, cw, ch);
+	if (!cw || !ch)
+		return;
 
-	XRenderSetPictureFilter(fl_display, src, "bilinear", NULL, 0);
-	XTransform xf;
-	memset(&xf, 0, sizeof(XTransform));
-	xf.matrix[0][0] = (65536 * cur->w) / W;
-	xf.matrix[1][1] = (65536 * cur->h) / H;
-	xf.matrix[2][2] = 65536;
-	XRenderSetPictureTransform(fl_display, src, &xf);
+	// Copy the block layout, a zoomed level may get replaced meanwhile
+	pthread_mutex_lock(&file->lock);
+	const struct pagelevel * const l = &pg->level[lvl];
+	if (!l->ready || !l->numblocks) {
+		pthread_mutex_unlock(&file->lock);
+		return;
+	}
+	const u32 lw = l->w, lh = l->h, num = l->numblocks;
+	const u16 lvldpi = l->dpi;
+	struct pageblock * const blocks =
+		(struct pageblock *) xmalloc(num * sizeof(struct pageblock));
+	memcpy(blocks, l->blocks, num * sizeof(struct pageblock));
+	pthread_mutex_unlock(&file->lock);
+
+	const Picture dst = target();
+	const XFixed sx = (65536 * lw) / W;
+	const XFixed sy = (65536 * lh) / H;
+
+	// The uploaded blocks in the clip go first, then the rest get
+	// decoded a cacheful at a time. Only the ones in the clip count.
+	u32 * const miss = (u32 *) xmalloc(num * sizeof(u32));
+	u32 i, j, missed = 0;
+	s32 bx, by, bx2, by2;
+
+	for (i = 0; i < num; i++) {
+		if (!inclip(&blocks[i], X, Y, W, H, lw, lh, cx, cy, cw, ch,
+				&bx, &by, &bx2, &by2))
+			continue;
+
+		frameblocks++;
+		const u8 c = iscached(page, lvl, lvldpi, i);
+		if (c == UCHAR_MAX) {
+			miss[missed++] = i;
+			continue;
+		}
+		cachedtick[c] = ++tick;
+		hits++;
+
+		scale(c, sx, sy);
+		blit(pict[c], dst, bx, by, bx2, by2);
+	}
+
+	misses += missed;
+	for (i = 0; i < missed; i += numslots) {
+		const u32 n = missed - i < numslots ? missed - i : numslots;
+		u8 slots[CACHE_MAX];
+
+		if (!docache(page, lvl, lvldpi, miss + i, slots, n))
+			break;
 
-	XRenderComposite(fl_display, PictOpSrc, src, None, dst, 0, 0, 0, 0, X, Y, W, H);
-//	XCopyArea(fl_display, pix[c], fl_window, fl_gc, 0, 0, W, H, X, Y);
-//	fl_draw_image(cache[c], X, Y, W, H, 4, file->cache[page].w * 4);
+		for (j = 0; j < n; j++) {
+			if (slots[j] == UCHAR_MAX)
+				continue;
+
+			inclip(&blocks[miss[i + j]], X, Y, W, H, lw, lh,
+				cx, cy, cw, ch, &bx, &by, &bx2, &by2);
+			scale(slots[j], sx, sy);
+			blit(pict[slots[j]], dst, bx, by, bx2, by2);
+		}
+	}
+
+	free(miss);
+	free(blocks);
 
 	if (selecting->value() && selx2 && sely2 && selx != selx2 && sely != sely2) {
 		// Draw a selection rectangle over this area
@@ -795,7 +1348,4 @@ void pdfview::content(const u32 page, const s32 X, const s32 Y,
 		XRenderFillRectangle(fl_display, PictOpOver, dst, &col,
 					x, y, w, h);
 	}
-
-	XRenderFreePicture(fl_display, src);
-	XRenderFreePicture(fl_display, dst);
 }
@@ -18,8 +18,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define VIEW_H
 
 #include "main.h"
+#include "pageindex.h"
+#include "upbuf.h"
 
-#define CACHE_MAX 3
+// Uploaded blocks kept around. A page is several strips. How many
+// slots are used follows what's on screen, within these bounds and
+// the bytes the Pixmaps may take.
+#define CACHE_MIN 8
+#define CACHE_MAX 96
+#define CACHE_BYTES (192 * 1024 * 1024)
 
 class pdfview: public Fl_Widget {
 public:
@@ -28,22 +35,88 @@ public:
 	int handle(int e);
 
 	void go(const u32 page);
+	void relayout();
+	void takeahead();
+	void stats() const;
 	void reset();
 	void resetselection();
 private:
-	u8 iscached(const u32 page) const;
-	void docache(const u32 page);
+	static void settle(void *);
+	u8 iscached(const u32 page, const u8 lvl, const u16 dpi,
+			const u32 blk) const;
+	bool docache(const u32 page, const u8 lvl, const u16 dpi,
+			const u32 * const blks, u8 * const slots, const u32 n);
+	u8 takeslot();
+	void drop(const u8 slot);
+	void trim();
+	void fitcache();
+	bool upload(const u8 slot, const struct upbuf * const b,
+			const u32 offset);
+	void scale(const u8 slot, const XFixed sx, const XFixed sy);
+	Picture target();
+	void scrolled(const float prev);
+	void ahead();
 	float maxyoff() const;
 	u32 pxrel(u32 page) const;
 	void content(const u32 page, const s32 X, const s32 y,
 			const u32 w, const u32 h);
+	void syncheights();
+	double pagetop(const u32 page, const u32 w) const;
+	u32 pageat(const double y, const u32 w) const;
+	double yoffpx(const float at, const u32 w) const;
+	float pxyoff(const double y, const u32 w) const;
+	void updatevisible(const float at, const u32 w, const u32 h,
+			const bool fromdraw);
 
 	float yoff, xoff;
-	u32 cachedsize;
-	u8 *cache[CACHE_MAX];
+
+	// Page heights for mapping between pixels and pages, and the mode
+	// and geometry generation they were taken at
+	pageindex heights;
+	u8 heightmode;
+	u32 heightgen;
+
+	u8 numslots;
+	u64 cachedbytes;
+
+	// A batch of missed blocks decompresses here, and is uploaded
+	// from here. The Pixmaps keep the pixels after that.
+	struct upbuf staging;
 	u16 cachedpage[CACHE_MAX];
+	u8 cachedlevel[CACHE_MAX];
+	u16 cacheddpi[CACHE_MAX];
+	u32 cachedblock[CACHE_MAX];
+	u32 cachedw[CACHE_MAX], cachedh[CACHE_MAX];
 	Pixmap pix[CACHE_MAX];
 
+	// Each Pixmap's Picture, and the scale last set on it
+	Picture pict[CACHE_MAX];
+	XFixed scalex[CACHE_MAX], scaley[CACHE_MAX];
+
+	// The window's, the drawable it was made for, and its clip
+	Picture winpict;
+	Window winpictfor;
+	XRectangle winclip;
+
+	// Least recently used goes first. Slots used since the current
+	// frame started are on screen, and blocks counts what it showed.
+	u32 tick, frametick;
+	u32 cachedtick[CACHE_MAX];
+	u32 frameblocks;
+
+	// For --details
+	u32 hits, misses, fetchedin;
+
+	// Scroll speed in pages per second, and the dpi last shown, to
+	// decode the pages ahead at
+	float speed;
+	u64 lastscroll;
+	u16 showndpi;
+
+	// Zoom last drawn at, and whether it has stayed put for a while
+	float lastzoom;
+	bool settled;
+
 	// Text selection coords
 	u16 selx, sely, selx2, sely2;
 };